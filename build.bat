@@ -5,7 +5,15 @@ set compiler_options=/MD /Zi /DEBUG:FULL -nologo
 set includes=/I"shared" /I"dependencies\glad\include" /I"dependencies/glfw-3.4/include" /I"dependencies/imgui" /I"dependencies/imgui/backend"
 set linker_options= /link /NOIMPLIB /INCREMENTAL:NO
 set libs=dependencies\glfw-3.4.bin.WIN64\lib-vc2022\glfw3.lib opengl32.lib user32.lib gdi32.lib shell32.lib windowsapp.lib
+if "%1"=="bench" goto bench
 cl -DCPROJ_SLOW=1 /LD %compiler_options% source\game.cpp %includes% /DBUILD_DLL /Fo:build\ /Fe:build\game.dll %linker_options% 
 if %ERRORLEVEL% neq 0 exit /b
 cl -DCPROJ_SLOW=1 %sources% %compiler_options% %includes% /Fo:build\ /Fe:build\Cproj.exe %linker_options% %libs%
-del vc140.pdb
\ No newline at end of file
+del vc140.pdb
+exit /b
+
+:bench
+rem Checks and benchmarks, optimized and without CPROJ_SLOW so the timings mean something. Extra arguments go to bench.exe.
+cl /O2 %compiler_options% source\bench.cpp /I"shared" /Fo:build\ /Fe:build\bench.exe %linker_options%
+if %ERRORLEVEL% neq 0 exit /b
+build\bench.exe %2
@@ -2,6 +2,11 @@
 #define CORE_H
 #include <stdint.h>
 #include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
 
 typedef int8_t   s8;
 typedef int16_t  s16;
@@ -21,13 +26,25 @@ typedef double   f64;
 #define assert(expression) printf("not slow");
 #endif
 
+// MSVC compiles AVX2 intrinsics anywhere, GCC and Clang need the function marked.
+#if defined(__GNUC__) || defined(__clang__)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_AVX2
+#endif
+
 #define MIN(a, b) (((a) < (b)) ? (a) : (b))
 #define MAX(a, b) (((a) > (b)) ? (a) : (b))
 #define SIGN(x) (((x) > 0) - ((x) < 0))
 
 #define KILOBYTE 1024
-#define PERSISTENT_ARENA_SIZE (1*KILOBYTE*KILOBYTE)
-#define FRAME_ARENA_SIZE ((KILOBYTE*KILOBYTE)/2)
+#define GIGABYTE (1024ull*KILOBYTE*KILOBYTE)
+#define CACHE_LINE_SIZE 64
+// Address space reserved per arena, pages are only committed as pushes reach them.
+#define PERSISTENT_ARENA_SIZE (16*GIGABYTE)
+#define FRAME_ARENA_SIZE (4*GIGABYTE)
+#define SCRATCH_ARENA_SIZE (4*GIGABYTE)
+#define ARENA_COMMIT_SIZE (64*KILOBYTE) // pages are committed in steps of this
 
 struct Vec2f {
     union {
@@ -73,9 +90,49 @@ struct Pointers {
 struct Arena {
     u8* data;
     u64 current;
-    u64 capacity;
+    u64 capacity;  // reserved
+    u64 committed; // from data, a multiple of ARENA_COMMIT_SIZE up to capacity
+    u32 commits;   // times the committed range grew
+    u64 high_water; // since the last arena_reset
 };
 
+u8* reserve_memory(u64 size) {
+#ifdef _WIN32
+    return (u8*)VirtualAlloc(NULL, size, MEM_RESERVE, PAGE_NOACCESS);
+#else
+    void* result = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return result == MAP_FAILED ? NULL : (u8*)result;
+#endif
+}
+
+// Committed pages read as zero until written.
+bool commit_memory(u8* start, u64 size) {
+#ifdef _WIN32
+    return VirtualAlloc(start, size, MEM_COMMIT, PAGE_READWRITE) != NULL;
+#else
+    return mprotect(start, size, PROT_READ | PROT_WRITE) == 0;
+#endif
+}
+
+// Reserves capacity bytes of address space and commits none of it, pointers into the arena never move.
+Arena arena_reserve(u64 capacity) {
+    Arena arena = {};
+    arena.data = reserve_memory(capacity);
+    assert(arena.data);
+    arena.capacity = capacity;
+    return arena;
+}
+
+// Commits pages until the first end bytes are backed.
+void arena_commit(Arena* arena, u64 end) {
+    assert(end <= arena->capacity);
+    u64 committed = MIN((end + ARENA_COMMIT_SIZE - 1) & ~(u64)(ARENA_COMMIT_SIZE - 1), arena->capacity);
+    bool success = commit_memory(arena->data + arena->committed, committed - arena->committed);
+    assert(success);
+    arena->committed = committed;
+    ++arena->commits;
+}
+
 u8* arena_current(Arena arena) {
     return arena.data + arena.current;
 }
@@ -84,16 +141,102 @@ u8* arena_current(Arena* arena) {
     return arena->data + arena->current;
 }
 
-u8* arena_append(Arena* arena, u32 data_size) {
-    assert(arena->current + data_size <= arena->capacity);
-    u8* result = arena->data + arena->current;
-    arena->current += data_size;
-    memset(result, 0, data_size);
+// Takes size bytes starting at the next multiple of alignment, a power of two. Zeroed unless zero is false,
+// for blocks that are written in full before anything reads them.
+u8* arena_push(Arena* arena, u64 size, u64 alignment, bool zero) {
+    u64 address = (u64)(arena->data + arena->current);
+    u64 start = arena->current + ((alignment - (address & (alignment - 1))) & (alignment - 1));
+    if (start + size > arena->committed) arena_commit(arena, start + size);
+    u8* result = arena->data + start;
+    arena->current = start + size;
+    arena->high_water = MAX(arena->high_water, arena->current);
+    if (zero) memset(result, 0, size);
     return result;
 }
 
-u32 arena_remaining(Arena arena) {
-    return arena.capacity - arena.current;
+#define push_struct(arena, T)                          ((T*)arena_push((arena), sizeof(T), alignof(T), true))
+#define push_struct_no_zero(arena, T)                  ((T*)arena_push((arena), sizeof(T), alignof(T), false))
+#define push_array(arena, T, count)                    ((T*)arena_push((arena), sizeof(T) * (count), alignof(T), true))
+#define push_array_no_zero(arena, T, count)            ((T*)arena_push((arena), sizeof(T) * (count), alignof(T), false))
+// For SIMD loads and cache lines, alignment is in bytes.
+#define push_array_aligned(arena, T, count, alignment) ((T*)arena_push((arena), sizeof(T) * (count), MAX((u64)(alignment), alignof(T)), true))
+
+// Byte written over memory that was given back, under CPROJ_SLOW.
+#define ARENA_POISON 0xCD
+
+// Gives back everything in the arena without clearing it, pushes zero what they hand out unless asked not to.
+// Under CPROJ_SLOW what was used since the last reset is poisoned, so a read through a stale pointer stands out.
+void arena_reset(Arena* arena) {
+#if CPROJ_SLOW
+    memset(arena->data, ARENA_POISON, arena->high_water);
+#endif
+    arena->current = 0;
+    arena->high_water = 0;
+}
+
+// Everything pushed after begin_temp_memory is given back by end_temp_memory, scopes nest like a stack.
+struct Temp_Memory {
+    Arena* arena;
+    u64    current;
+};
+
+Temp_Memory begin_temp_memory(Arena* arena) {
+    return Temp_Memory{ arena, arena->current };
+}
+
+void end_temp_memory(Temp_Memory temp) {
+    assert(temp.arena->current >= temp.current);
+#if CPROJ_SLOW
+    memset(temp.arena->data + temp.current, ARENA_POISON, temp.arena->current - temp.current);
+#endif
+    temp.arena->current = temp.current;
+}
+
+// Arenas for transient work like parsing and serializing, so it never lands in the persistent arena.
+// Two are enough: a function handed one of them for its results takes its scratch from the other.
+#define SCRATCH_ARENAS_COUNT 2
+struct Scratch_Pool {
+    Arena* arenas[SCRATCH_ARENAS_COUNT];
+};
+
+// A scope on a scratch arena other than conflict, which can be NULL. End it with end_temp_memory.
+Temp_Memory get_scratch(Scratch_Pool* pool, Arena* conflict) {
+    for (u32 i = 0; i < SCRATCH_ARENAS_COUNT; ++i) {
+        if (pool->arenas[i] != conflict) return begin_temp_memory(pool->arenas[i]);
+    }
+    assert(false);
+    return Temp_Memory{};
+}
+
+//
+// Frame arenas
+// Two arenas that trade places every frame, so what one frame pushed can still be read during the next.
+
+struct Frame_Arenas {
+    Arena arenas[2];
+    u64   frame; // frames begun, this frame pushes into arenas[frame & 1]
+};
+
+// Resets the arena from two frames ago and returns it as this frame's.
+Arena* frame_arenas_begin(Frame_Arenas* frames) {
+    ++frames->frame;
+    Arena* current = &frames->arenas[frames->frame & 1];
+    arena_reset(current);
+    return current;
+}
+
+Arena* frame_arena_current(Frame_Arenas* frames) {
+    return &frames->arenas[frames->frame & 1];
+}
+
+// Holds what last frame pushed until the next frame_arenas_begin.
+Arena* frame_arena_previous(Frame_Arenas* frames) {
+    return &frames->arenas[(frames->frame + 1) & 1];
+}
+
+// Whether data pushed during frame is still there, for data stamped with frames->frame when it was pushed.
+bool frame_data_alive(Frame_Arenas* frames, u64 frame) {
+    return frame == frames->frame || frame + 1 == frames->frame;
 }
 
 #endif // CORE_H
\ No newline at end of file
@@ -1,12 +1,111 @@
 #include <cstdio>
 #include <math.h>
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
 #include "game.h"
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
-u32 serialize_entity(Entity entity, Arena arena) {
+//
+// Entity store
+
+// Starts this frame's journal, before anything touches the store.
+void journal_begin(Entity_Journal* journal, Arena* frame) {
+    journal->entries = push_array_no_zero(frame, Journal_Entry, JOURNAL_CAPACITY);
+    journal->count = 0;
+    ++journal->frame;
+    journal->overflowed = false;
+}
+
+// Call before the change, the first one this frame saves what the slot was.
+void journal_record(Entity_Store* entities, u32 slot, Journal_Change change) {
+    Entity_Journal* journal = &entities->journal;
+    if (journal->overflowed) return;
+    Journal_Mark* mark = &entities->journal_mark[slot];
+    if (mark->frame == journal->frame) {
+        journal->entries[mark->index].changes |= change;
+        return;
+    }
+    if (journal->count == JOURNAL_CAPACITY) {
+        journal->overflowed = true;
+        return;
+    }
+    *mark = Journal_Mark{ journal->frame, journal->count };
+    Journal_Entry* entry = journal->entries + journal->count++;
+    entry->slot          = slot;
+    entry->previous_type = entities->type[slot];
+    entry->previous_rect = entities->rect[slot];
+    entry->changes       = change;
+}
+
+Rectf entity_rect(Entity_Store* entities, u32 slot) {
+    return entities->rect[slot];
+}
+
+void set_entity_rect(Entity_Store* entities, u32 slot, Rectf rect) {
+    Rectf* current = &entities->rect[slot];
+    if (rect.posx != current->posx || rect.posy != current->posy || rect.radiusx != current->radiusx || rect.radiusy != current->radiusy) {
+        journal_record(entities, slot, JOURNAL_MOVED);
+    }
+    *current = rect;
+}
+
+Entity get_entity(Entity_Store* entities, u32 slot) {
+    Entity result;
+    result.type         = entities->type[slot];
+    result.rect         = entity_rect(entities, slot);
+    result.move_speed   = entities->cold[slot].move_speed;
+    result.facing       = entities->cold[slot].facing;
+    result.grounded     = entities->grounded[slot];
+    result.standing_on  = entities->standing_on[slot];
+    result.velocity     = entities->velocity[slot];
+    result.still_frames = entities->still_frames[slot];
+    result.asleep       = entities->asleep[slot];
+    return result;
+}
+
+void set_entity(Entity_Store* entities, u32 slot, Entity entity) {
+    entities->type[slot]         = entity.type;
+    entities->rect[slot]         = entity.rect;
+    entities->cold[slot]         = Entity_Cold{ entity.move_speed, entity.facing };
+    entities->grounded[slot]     = entity.grounded;
+    entities->standing_on[slot]  = entity.standing_on;
+    entities->velocity[slot]     = entity.velocity;
+    entities->still_frames[slot] = entity.still_frames;
+    entities->asleep[slot]       = entity.asleep;
+}
+
+Entity_Handle entity_handle(Entity_Store* entities, u32 slot) {
+    return ((u32)entities->generation[slot] << HANDLE_SLOT_BITS) | slot;
+}
+
+u32 handle_slot(Entity_Handle handle) {
+    return handle & HANDLE_SLOT_MASK;
+}
+
+// False for 0 and for handles whose slot was freed since, whether or not it has been reused.
+bool entity_alive(Entity_Store* entities, Entity_Handle handle) {
+    u32 slot = handle_slot(handle);
+    return handle && slot < entities->count && entities->generation[slot] == handle >> HANDLE_SLOT_BITS;
+}
+
+// Invalidates every handle to the slot.
+void next_generation(Entity_Store* entities, u32 slot) {
+    u16 generation = (entities->generation[slot] + 1) & HANDLE_GENERATION_MASK;
+    entities->generation[slot] = generation ? generation : 1;
+}
+
+// Appends the entity's line to the arena.
+u32 serialize_entity(Entity entity, Arena* arena) {
     Rectf rect = entity.rect;
-    u32 chars_written = snprintf((char* const)arena_current(arena), arena_remaining(arena), "Entity: type=%d posx=%g posy=%g radiusx=%g radiusy=%g move_speed=%g facing=%d\n", entity.type, rect.posx, rect.posy, rect.radiusx, rect.radiusy, entity.move_speed, entity.facing);
+    char line[256];
+    u32 chars_written = snprintf(line, sizeof(line), "Entity: type=%d posx=%g posy=%g radiusx=%g radiusy=%g move_speed=%g facing=%d\n", entity.type, rect.posx, rect.posy, rect.radiusx, rect.radiusy, entity.move_speed, entity.facing);
+    assert(chars_written < sizeof(line));
+    memcpy(push_array_no_zero(arena, char, chars_written), line, chars_written);
     return chars_written;
 }
 
@@ -30,30 +129,31 @@ Vec2f move_camera(Vec2f last_pos, Input* input) {
 const f32 JUMP_VELOCITY = .2f;
 const f32 GRAVITY = .005f;
 const f32 TERMINAL_VELOCITY = 1.5f;
-Vec2f get_player_pos_delta(Player* player, Input* input, Collision_Info* last_info) {
-    Entity* entity = player->e;
+Vec2f get_player_pos_delta(Player* player, Entity_Store* entities, Input* input, Collision_Info* last_info) {
+    u32 e = handle_slot(player->e);
+    Vec2f* velocity = &entities->velocity[e];
     Vec2f pos = {};
     if (input[INPUT_RIGHT].down) {
         pos.x += .1f;
-        entity->facing = DIR_RIGHT;
+        entities->cold[e].facing = DIR_RIGHT;
     }
     if (input[INPUT_LEFT].down) {
         pos.x -= .1f;
-        entity->facing = DIR_LEFT;
+        entities->cold[e].facing = DIR_LEFT;
     }
-    entity->grounded = last_info->sides_touched & DIR_DOWN;
+    entities->grounded[e] = last_info->sides_touched & DIR_DOWN;
 
-    if (entity->grounded) {
-        entity->velocity.y = 0;
+    if (entities->grounded[e]) {
+        velocity->y = 0;
         if (input[INPUT_UP].down) {
-            entity->velocity.y = JUMP_VELOCITY;
-            entity->grounded = false;
+            velocity->y = JUMP_VELOCITY;
+            entities->grounded[e] = false;
         }
     }
 
-    entity->velocity.y -= GRAVITY;
-    if (entity->velocity.y < -TERMINAL_VELOCITY) entity->velocity.y = -TERMINAL_VELOCITY;
-    pos.y += entity->velocity.y;
+    velocity->y -= GRAVITY;
+    if (velocity->y < -TERMINAL_VELOCITY) velocity->y = -TERMINAL_VELOCITY;
+    pos.y += velocity->y;
     
     last_info->sides_touched = 0;
     return pos;
@@ -82,17 +182,101 @@ bool rectf_overlap(Rectf a, Rectf b, Rectf* result) {
     return true;
 }
 
-u32 first_overlap_index(Rectf rect, Entity* others, u32 others_count, Entity_Type_Flag types_to_check) {
-    for (int i = 0; i < others_count; ++i) {
-        Entity other = others[i];
-        if (!(other.type & types_to_check)) continue;
-        Rectf result;
-        if (rectf_overlap(rect, other.rect, &result))
-        {
-            return i;
-        }
+bool check_collided(Rectf a, Rectf b) {
+    f32 overlap_x  = (a.radiusx + b.radiusx - fabsf(a.posx - b.posx));
+    f32 overlap_y = (a.radiusy + b.radiusy - fabsf(a.posy - b.posy));
+    return (overlap_x > 0 && overlap_y > 0);
+}
+
+//
+// Batched overlap
+// Tests one rect against 4 or 8 packed rects with the same operations as check_collided, so the bits match it exactly.
+// Edge-touching rects give an overlap of exactly 0 in both and don't count.
+// The AVX2 path is picked at runtime, machines without it fall back to two SSE2 batches.
+Rectf packed_rect(Packed_Rects rects, u32 index) {
+    return Rectf{ rects.posx[index], rects.posy[index], rects.radiusx[index], rects.radiusy[index] };
+}
+
+u32 count_trailing_zeros(u32 mask) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+bool cpu_has_avx2() {
+    // Cached per load of the game code, a reloaded DLL just asks again.
+    static s32 cached = -1;
+    if (cached >= 0) return cached;
+    s32 info[4] = {};
+#ifdef _MSC_VER
+    __cpuid(info, 1);
+    bool os_saves_ymm = (info[2] & (1 << 27)) && (_xgetbv(0) & 6) == 6;
+    __cpuidex(info, 7, 0);
+#else
+    __cpuid(1, info[0], info[1], info[2], info[3]);
+    u32 xcr0_low = 0, xcr0_high = 0;
+    if (info[2] & (1 << 27)) __asm__("xgetbv" : "=a"(xcr0_low), "=d"(xcr0_high) : "c"(0));
+    bool os_saves_ymm = (info[2] & (1 << 27)) && (xcr0_low & 6) == 6;
+    __cpuid_count(7, 0, info[0], info[1], info[2], info[3]);
+#endif
+    cached = os_saves_ymm && (info[1] & (1 << 5));
+    return cached;
+}
+
+// Lanes [start, start + 4), the caller masks off lanes past the end of its range.
+u32 overlap_mask_4(Rectf rect, Packed_Rects rects, u32 start) {
+    __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+    __m128 zero = _mm_setzero_ps();
+    __m128 overlap_x = _mm_sub_ps(_mm_add_ps(_mm_set1_ps(rect.radiusx), _mm_loadu_ps(rects.radiusx + start)),
+                                  _mm_and_ps(abs_mask, _mm_sub_ps(_mm_set1_ps(rect.posx), _mm_loadu_ps(rects.posx + start))));
+    __m128 overlap_y = _mm_sub_ps(_mm_add_ps(_mm_set1_ps(rect.radiusy), _mm_loadu_ps(rects.radiusy + start)),
+                                  _mm_and_ps(abs_mask, _mm_sub_ps(_mm_set1_ps(rect.posy), _mm_loadu_ps(rects.posy + start))));
+    __m128 hit = _mm_and_ps(_mm_cmpgt_ps(overlap_x, zero), _mm_cmpgt_ps(overlap_y, zero));
+    return _mm_movemask_ps(hit);
+}
+
+TARGET_AVX2 void overlap_masks_avx2(Rectf rect, Packed_Rects rects, u32 begin, u32 end, u8* masks) {
+    __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF));
+    __m256 zero = _mm256_setzero_ps();
+    __m256 posx    = _mm256_set1_ps(rect.posx);
+    __m256 posy    = _mm256_set1_ps(rect.posy);
+    __m256 radiusx = _mm256_set1_ps(rect.radiusx);
+    __m256 radiusy = _mm256_set1_ps(rect.radiusy);
+    for (u32 i = begin; i < end; i += 8) {
+        __m256 overlap_x = _mm256_sub_ps(_mm256_add_ps(radiusx, _mm256_loadu_ps(rects.radiusx + i)),
+                                         _mm256_and_ps(abs_mask, _mm256_sub_ps(posx, _mm256_loadu_ps(rects.posx + i))));
+        __m256 overlap_y = _mm256_sub_ps(_mm256_add_ps(radiusy, _mm256_loadu_ps(rects.radiusy + i)),
+                                         _mm256_and_ps(abs_mask, _mm256_sub_ps(posy, _mm256_loadu_ps(rects.posy + i))));
+        __m256 hit = _mm256_and_ps(_mm256_cmp_ps(overlap_x, zero, _CMP_GT_OQ), _mm256_cmp_ps(overlap_y, zero, _CMP_GT_OQ));
+        *masks++ = _mm256_movemask_ps(hit);
+    }
+}
+
+void overlap_masks_sse2(Rectf rect, Packed_Rects rects, u32 begin, u32 end, u8* masks) {
+    for (u32 i = begin; i < end; i += 8) {
+        *masks++ = overlap_mask_4(rect, rects, i) | (overlap_mask_4(rect, rects, i + 4) << 4);
+    }
+}
+
+// One 8 lane mask per block of [begin, end), lanes past end are cleared. The dispatch happens once per range,
+// calling into the AVX2 function for every batch costs more than the batch itself.
+u32 overlap_masks(Rectf rect, Packed_Rects rects, u32 begin, u32 end, u8* masks) {
+    if (begin >= end) return 0;
+    u32 masks_count = (end - begin + 7) / 8;
+    if (cpu_has_avx2()) overlap_masks_avx2(rect, rects, begin, end, masks);
+    else                overlap_masks_sse2(rect, rects, begin, end, masks);
+    masks[masks_count - 1] &= 0xFF >> (masks_count * 8 - (end - begin));
+#if CPROJ_SLOW
+    for (u32 i = begin; i < end; ++i) {
+        bool hit = (masks[(i - begin) / 8] >> ((i - begin) % 8)) & 1;
+        assert(hit == check_collided(rect, packed_rect(rects, i)));
     }
-    return others_count;
+#endif
+    return masks_count;
 }
 
 // u32 first_overlap_index_against_index(u32 rect_index, Entity* others, u32 others_count, Entity_Type_Flag types_to_check) {
@@ -110,27 +294,1013 @@ u32 first_overlap_index(Rectf rect, Entity* others, u32 others_count, Entity_Typ
 //     return others_count;
 // }
 
-u32 get_overlaps(Rectf rect, Rectf* others, u32 others_count, Rectf* results) {
+//
+// Sweep and prune
+// Insertion sort on the left edges, which is nearly linear when the order from last frame still mostly holds.
+// Only the slots of types are in the order, it is walked instead of the store.
+void sweep_and_prune_update(Sweep_And_Prune* sweep, Entity_Store* entities, Entity_Type_Flag types) {
+    u32 entities_count = entities->count;
+    // Drop the slots that were deleted or reused for another type, the count shrinks when a level is loaded.
+    u32 kept = 0;
+    for (u32 i = 0; i < sweep->count; ++i) {
+        u32 slot = sweep->order[i];
+        if (slot < entities_count && (entities->type[slot] & types)) sweep->order[kept++] = slot;
+        else                                                         sweep->in_order[slot] = false;
+    }
+    sweep->count = kept;
+    for (u32 t = 0; t < ENTITY_TYPE_COUNT; ++t) {
+        if (!(types & (1 << t))) continue;
+        Entity_Table* table = entities->tables + t;
+        for (u32 i = 0; i < table->count; ++i) {
+            u32 slot = table->slots[i];
+            if (sweep->in_order[slot]) continue;
+            sweep->in_order[slot] = true;
+            sweep->order[sweep->count++] = slot;
+        }
+    }
+
+    sweep->max_width = 0;
+    for (u32 i = 0; i < sweep->count; ++i) {
+        Rectf rect = entity_rect(entities, sweep->order[i]);
+        sweep->minx[i] = rect.posx - rect.radiusx;
+        sweep->max_width = MAX(sweep->max_width, rect.radiusx * 2);
+    }
+    for (u32 i = 1; i < sweep->count; ++i) {
+        f32 key   = sweep->minx[i];
+        u32 index = sweep->order[i];
+        u32 j = i;
+        while (j > 0 && sweep->minx[j - 1] > key) {
+            sweep->minx[j]  = sweep->minx[j - 1];
+            sweep->order[j] = sweep->order[j - 1];
+            --j;
+        }
+        sweep->minx[j]  = key;
+        sweep->order[j] = index;
+    }
+    for (u32 i = 0; i < sweep->count; ++i) {
+        Rectf rect = entity_rect(entities, sweep->order[i]);
+        sweep->posx[i]    = rect.posx;
+        sweep->posy[i]    = rect.posy;
+        sweep->radiusx[i] = rect.radiusx;
+        sweep->radiusy[i] = rect.radiusy;
+    }
+}
+
+// Grows the arrays to fit count slots, doubling so the capacities left behind in the arena add up to at most what's in use.
+void sweep_and_prune_reserve(Sweep_And_Prune* sweep, u32 count, Arena* arena) {
+    if (count <= sweep->capacity) return;
+    u32 capacity = MAX(sweep->capacity * 2, ENTITY_CHUNK_SIZE);
+    while (capacity < count) capacity *= 2;
+    // Copied whole, try_move_axis can still read them before the next update re-sorts.
+    Sweep_And_Prune old = *sweep;
+    sweep->order    = push_array(arena, u32, capacity);
+    sweep->in_order = push_array(arena, bool, capacity);
+    sweep->minx     = push_array(arena, f32, capacity);
+    // Read 8 at a time from a multiple of 8, aligned the loads never split a cache line.
+    sweep->posx     = push_array_aligned(arena, f32, capacity + 8, 32);
+    sweep->posy     = push_array_aligned(arena, f32, capacity + 8, 32);
+    sweep->radiusx  = push_array_aligned(arena, f32, capacity + 8, 32);
+    sweep->radiusy  = push_array_aligned(arena, f32, capacity + 8, 32);
+    sweep->capacity = capacity;
+    if (!old.count) return;
+    memcpy(sweep->in_order, old.in_order, sizeof(bool) * old.capacity);
+    memcpy(sweep->order,    old.order,    sizeof(u32) * old.count);
+    memcpy(sweep->minx,     old.minx,     sizeof(f32) * old.count);
+    memcpy(sweep->posx,     old.posx,     sizeof(f32) * old.count);
+    memcpy(sweep->posy,     old.posy,     sizeof(f32) * old.count);
+    memcpy(sweep->radiusx,  old.radiusx,  sizeof(f32) * old.count);
+    memcpy(sweep->radiusy,  old.radiusy,  sizeof(f32) * old.count);
+}
+
+Packed_Rects sweep_rects(Sweep_And_Prune* sweep) {
+    return Packed_Rects{ sweep->posx, sweep->posy, sweep->radiusx, sweep->radiusy, sweep->count };
+}
+
+// First position in the order whose left edge is at or past minx.
+u32 sweep_lower_bound(Sweep_And_Prune* sweep, f32 minx) {
+    u32 low = 0;
+    u32 high = sweep->count;
+    while (low < high) {
+        u32 mid = (low + high) / 2;
+        if (sweep->minx[mid] < minx) low = mid + 1;
+        else                         high = mid;
+    }
+    return low;
+}
+
+bool rectf_contains(Rectf outer, Rectf inner) {
+    return outer.posx - outer.radiusx <= inner.posx - inner.radiusx && outer.posx + outer.radiusx >= inner.posx + inner.radiusx &&
+           outer.posy - outer.radiusy <= inner.posy - inner.radiusy && outer.posy + outer.radiusy >= inner.posy + inner.radiusy;
+}
+
+// Distance to the next float past magnitude, more than rounding moves an edge computed from coordinates of up to
+// half that size. magnitude is never negative, so the next float up is the next bit pattern, nextafterf is a
+// library call and every swept box takes two of these.
+f32 float_step(f32 magnitude) {
+    u32 bits;
+    memcpy(&bits, &magnitude, sizeof(bits));
+    ++bits;
+    f32 next;
+    memcpy(&next, &bits, sizeof(next));
+    return next - magnitude;
+}
+
+// Radius around pos that reaches past min and max by a float step of the coordinates. Edges computed as center
+// minus radius are already rounded, a rect can overlap the one they came from by less than that and check_collided
+// still sees it. Rounding the new center and radius can pull an edge back in, so the radius grows until it can't.
+f32 covering_radius(f32 pos, f32 min, f32 max) {
+    f32 step = float_step(2 * MAX(fabsf(min), fabsf(max)));
+    f32 radius = MAX(max - pos, pos - min) + step;
+    while (pos - radius >= min || pos + radius <= max) radius += step;
+    return radius;
+}
+
+// Holds both rects with a little to spare, whatever check_collided finds overlapping either overlaps the union.
+Rectf rectf_union(Rectf a, Rectf b) {
+    f32 minx = MIN(a.posx - a.radiusx, b.posx - b.radiusx);
+    f32 miny = MIN(a.posy - a.radiusy, b.posy - b.radiusy);
+    f32 maxx = MAX(a.posx + a.radiusx, b.posx + b.radiusx);
+    f32 maxy = MAX(a.posy + a.radiusy, b.posy + b.radiusy);
+    f32 posx = minx + (maxx - minx) / 2;
+    f32 posy = miny + (maxy - miny) / 2;
+    return Rectf{ posx, posy, covering_radius(posx, minx, maxx), covering_radius(posy, miny, maxy) };
+}
+
+//
+// Static tree
+// Built top down, splitting each node at the median center along its longest axis. Halving every level keeps the
+// depth near log2(n / 4), which the fixed traversal stacks rely on.
+
+// Reorders items so the one at k is where sorting by center along axis would put it, nothing before it is further
+// along and nothing after it is less far. Quickselect around a median of three.
+void static_tree_select(Entity_Store* entities, u32* items, u32 count, u32 k, Axis axis) {
+    s32 low = 0;
+    s32 high = count - 1;
+    while (low < high) {
+        f32 a = entities->rect[items[low]].pos.a[axis];
+        f32 b = entities->rect[items[(low + high) / 2]].pos.a[axis];
+        f32 c = entities->rect[items[high]].pos.a[axis];
+        f32 pivot = MAX(MIN(a, b), MIN(MAX(a, b), c));
+        s32 i = low;
+        s32 j = high;
+        while (i <= j) {
+            while (entities->rect[items[i]].pos.a[axis] < pivot) ++i;
+            while (entities->rect[items[j]].pos.a[axis] > pivot) --j;
+            if (i <= j) {
+                u32 swap = items[i];
+                items[i++] = items[j];
+                items[j--] = swap;
+            }
+        }
+        if      ((s32)k <= j) high = j;
+        else if ((s32)k >= i) low = i;
+        else break;
+    }
+}
+
+u32 static_tree_build_node(Static_Tree* tree, Entity_Store* entities, u32 node_index, u32 start, u32 count) {
+    u32* items = tree->leaf_entities + start;
+    Rectf bounds = entity_rect(entities, items[0]);
+    for (u32 i = 1; i < count; ++i) {
+        bounds = rectf_union(bounds, entity_rect(entities, items[i]));
+    }
+    Static_Tree_Node* node = tree->nodes + node_index;
+    node->bounds = bounds;
+    if (count <= STATIC_TREE_LEAF_SIZE) {
+        node->first = start;
+        node->count = count;
+        return node_index;
+    }
+
+    Axis axis = bounds.radiusx >= bounds.radiusy ? AXIS_X : AXIS_Y;
+    u32 left_count = count / 2;
+    static_tree_select(entities, items, count, left_count, axis);
+
+    u32 first_child = tree->nodes_count;
+    tree->nodes_count += 2;
+    node->first = first_child;
+    node->count = 0;
+    static_tree_build_node(tree, entities, first_child,     start,              left_count);
+    static_tree_build_node(tree, entities, first_child + 1, start + left_count, count - left_count);
+    return node_index;
+}
+
+void static_tree_pack_rects(Static_Tree* tree, Entity_Store* entities, u32 start, u32 count) {
+    for (u32 i = start; i < start + count; ++i) {
+        Rectf rect = entity_rect(entities, tree->leaf_entities[i]);
+        tree->posx[i]    = rect.posx;
+        tree->posy[i]    = rect.posy;
+        tree->radiusx[i] = rect.radiusx;
+        tree->radiusy[i] = rect.radiusy;
+    }
+}
+
+// Nothing is copied, a full bake rewrites every array.
+void static_tree_reserve(Static_Tree* tree, u32 count, Arena* arena) {
+    if (count <= tree->capacity) return;
+    u32 capacity = MAX(tree->capacity * 2, ENTITY_CHUNK_SIZE);
+    while (capacity < count) capacity *= 2;
+    tree->nodes         = push_array_no_zero(arena, Static_Tree_Node, 2 * capacity);
+    tree->leaf_entities = push_array_no_zero(arena, u32, capacity);
+    // Leaves are read 4 at a time.
+    tree->posx          = push_array(arena, f32, capacity + 8);
+    tree->posy          = push_array(arena, f32, capacity + 8);
+    tree->radiusx       = push_array(arena, f32, capacity + 8);
+    tree->radiusy       = push_array(arena, f32, capacity + 8);
+    tree->capacity = capacity;
+}
+
+// Leaves as much free room again as the bake takes, for rebakes.
+void static_tree_build(Static_Tree* tree, Entity_Store* entities, Entity_Type type, Arena* arena) {
+    tree->type = type;
+    u32 statics_count = 0;
+    for (u32 i = 0; i < entities->count; ++i) {
+        statics_count += entities->type[i] == type;
+    }
+    static_tree_reserve(tree, 2 * statics_count, arena);
+    statics_count = 0;
+    for (u32 i = 0; i < entities->count; ++i) {
+        if (entities->type[i] != type) continue;
+        tree->leaf_entities[statics_count++] = i;
+    }
+    tree->nodes_count = 0;
+    tree->leaves_count = statics_count;
+    if (!statics_count) return;
+    tree->nodes_count = 1;
+    static_tree_build_node(tree, entities, 0, 0, statics_count);
+    static_tree_pack_rects(tree, entities, 0, statics_count);
+}
+
+void static_layer_build(Static_Layer* layer, Entity_Store* entities, Arena* arena) {
+    static_tree_build(&layer->solids, entities, ENTITY_STATIC, arena);
+    static_tree_build(&layer->spikes, entities, ENTITY_SPIKE, arena);
+    layer->solids_sweep_stale = true;
+}
+
+// Appends the slots under node that still hold the tree's type after the used leaf entries, up to room of them.
+// Returns room + 1 when there are more.
+u32 static_tree_gather(Static_Tree* tree, Entity_Store* entities, u32 node_index, u32 room) {
+    u32 gathered = 0;
+    u32 stack[64];
+    u32 stack_count = 0;
+    stack[stack_count++] = node_index;
+    while (stack_count) {
+        Static_Tree_Node* node = tree->nodes + stack[--stack_count];
+        if (node->count) {
+            for (u32 i = 0; i < node->count; ++i) {
+                u32 slot = tree->leaf_entities[node->first + i];
+                if (entities->type[slot] != tree->type) continue;
+                if (gathered == room) return room + 1;
+                tree->leaf_entities[tree->leaves_count + gathered++] = slot;
+            }
+        } else {
+            assert(stack_count + 2 <= 64);
+            stack[stack_count++] = node->first;
+            stack[stack_count++] = node->first + 1;
+        }
+    }
+    return gathered;
+}
+
+// Rebuilds the deepest subtree on path that still holds something once the slots that left the tree's type are dropped
+// and added is put in. The rebuilt subtree goes after the used entries and nodes, what it replaces is left behind.
+// Ancestors keep their bounds, so the subtree must not reach past them. Bakes the whole tree at the root or once the
+// room runs out.
+void static_tree_rebake(Static_Tree* tree, Entity_Store* entities, u32* path, u32 path_count, s32 added, Arena* arena) {
+    while (path_count) {
+        u32 node_index = path[--path_count];
+        if (node_index == 0 || tree->leaves_count + (added >= 0) > tree->capacity) break;
+        u32 room = tree->capacity - tree->leaves_count - (added >= 0);
+        u32 start = tree->leaves_count;
+        u32 count = static_tree_gather(tree, entities, node_index, room);
+        if (count > room) break;
+        if (added >= 0) tree->leaf_entities[start + count++] = added;
+        // Nodes can't be empty, an emptied subtree goes one level up.
+        if (!count) continue;
+        if (tree->nodes_count + 2 * count > 2 * tree->capacity) break;
+        static_tree_build_node(tree, entities, node_index, start, count);
+        static_tree_pack_rects(tree, entities, start, count);
+        tree->leaves_count += count;
+        return;
+    }
+    static_tree_build(tree, entities, tree->type, arena);
+}
+
+// Puts the slot in the deepest subtree whose bounds already cover its rect on their own.
+void static_layer_add(Static_Layer* layer, Entity_Store* entities, u32 slot, Arena* arena) {
+    Entity_Type type = entities->type[slot];
+    Static_Tree* tree = type == ENTITY_STATIC ? &layer->solids : &layer->spikes;
+    layer->solids_sweep_stale |= type == ENTITY_STATIC;
+    Rectf rect = entity_rect(entities, slot);
+    if (!tree->nodes_count || !rectf_contains(tree->nodes[0].bounds, rect)) {
+        static_tree_build(tree, entities, type, arena);
+        return;
+    }
+    u32 path[64];
+    u32 path_count = 0;
+    path[path_count++] = 0;
+    while (true) {
+        Static_Tree_Node* node = tree->nodes + path[path_count - 1];
+        if (node->count) break;
+        bool in_first  = rectf_contains(tree->nodes[node->first].bounds, rect);
+        bool in_second = rectf_contains(tree->nodes[node->first + 1].bounds, rect);
+        if (in_first == in_second) break;
+        assert(path_count < 64);
+        path[path_count++] = in_first ? node->first : node->first + 1;
+    }
+    static_tree_rebake(tree, entities, path, path_count, slot, arena);
+}
+
+// Path from node down to the leaf holding slot, only through nodes that overlap rect.
+bool static_tree_find(Static_Tree* tree, u32 node_index, u32 slot, Rectf rect, u32* path, u32* path_count) {
+    Static_Tree_Node* node = tree->nodes + node_index;
+    if (!check_collided(rect, node->bounds)) return false;
+    assert(*path_count < 64);
+    path[(*path_count)++] = node_index;
+    if (node->count) {
+        for (u32 i = node->first; i < node->first + node->count; ++i) {
+            if (tree->leaf_entities[i] == slot) return true;
+        }
+    } else if (static_tree_find(tree, node->first,     slot, rect, path, path_count) ||
+               static_tree_find(tree, node->first + 1, slot, rect, path, path_count)) {
+        return true;
+    }
+    --*path_count;
+    return false;
+}
+
+// Takes out a slot that was just deleted, rect is what it covered. Only the leaf it was in is rebuilt.
+void static_layer_remove(Static_Layer* layer, Entity_Store* entities, Entity_Type type, u32 slot, Rectf rect, Arena* arena) {
+    Static_Tree* tree = type == ENTITY_STATIC ? &layer->solids : &layer->spikes;
+    layer->solids_sweep_stale |= type == ENTITY_STATIC;
+    u32 path[64];
+    u32 path_count = 0;
+    if (!tree->nodes_count || !static_tree_find(tree, 0, slot, rect, path, &path_count)) return;
+    static_tree_rebake(tree, entities, path, path_count, -1, arena);
+}
+
+Packed_Rects static_tree_rects(Static_Tree* tree) {
+    return Packed_Rects{ tree->posx, tree->posy, tree->radiusx, tree->radiusy, tree->capacity };
+}
+
+// Pushes the slots whose leaf overlaps rect, one u32 each.
+u32 static_tree_query(Static_Tree* tree, Rectf rect, Arena* arena) {
     u32 results_count = 0;
-    for (int i = 0; i < others_count; ++i) {
-        Rectf result;
-        if (rectf_overlap(rect, others[i], &result))
-        {
-            results[results_count++] = result;
+    u32 stack[64];
+    u32 stack_count = 0;
+    if (tree->nodes_count) stack[stack_count++] = 0;
+    while (stack_count) {
+        Static_Tree_Node* node = tree->nodes + stack[--stack_count];
+        if (!check_collided(rect, node->bounds)) continue;
+        if (node->count) {
+            u32* results = push_array_no_zero(arena, u32, node->count);
+            memcpy(results, tree->leaf_entities + node->first, sizeof(u32) * node->count);
+            results_count += node->count;
+        } else {
+            assert(stack_count + 2 <= 64);
+            stack[stack_count++] = node->first;
+            stack[stack_count++] = node->first + 1;
         }
     }
     return results_count;
 }
 
-bool check_collided(Rectf a, Rectf b) {
-    f32 overlap_x  = (a.radiusx + b.radiusx - fabsf(a.posx - b.posx));
-    f32 overlap_y = (a.radiusy + b.radiusy - fabsf(a.posy - b.posy));
-    return (overlap_x > 0 && overlap_y > 0);
+// Whether rect overlaps any of the tree's rects, touching doesn't count.
+bool static_tree_overlaps(Static_Tree* tree, Rectf rect) {
+    u32 stack[64];
+    u32 stack_count = 0;
+    if (tree->nodes_count) stack[stack_count++] = 0;
+    while (stack_count) {
+        Static_Tree_Node* node = tree->nodes + stack[--stack_count];
+        if (!check_collided(rect, node->bounds)) continue;
+        if (node->count) {
+            if (overlap_mask_4(rect, static_tree_rects(tree), node->first) & ((1 << node->count) - 1)) return true;
+        } else {
+            assert(stack_count + 2 <= 64);
+            stack[stack_count++] = node->first;
+            stack[stack_count++] = node->first + 1;
+        }
+    }
+    return false;
+}
+
+//
+// Dynamic tree
+// Insertion picks the sibling by perimeter cost and rotations keep the tree balanced, same scheme as Box2D.
+const f32 DYNAMIC_TREE_MARGIN = .2f;
+// A reinserted box also reaches this many frames of the mover's velocity ahead, so falling things aren't reinserted
+// every frame.
+const f32 DYNAMIC_TREE_DISPLACEMENT_FRAMES = 8.f;
+#define TREE_NULL -1
+
+f32 rectf_perimeter(Rectf r) {
+    return 4 * (r.radiusx + r.radiusy);
+}
+
+void dynamic_tree_clear(Dynamic_Tree* tree) {
+    tree->nodes_count = 0;
+    tree->root = TREE_NULL;
+    tree->free_node = TREE_NULL;
+    tree->leaves_count = 0;
+    tree->moved_count = 0;
+    for (u32 i = 0; i < ENTITY_CHUNKS_CAPACITY && tree->leaf_of_entity.chunks[i]; ++i) {
+        memset(tree->leaf_of_entity.chunks[i], 0, sizeof(u32) * ENTITY_CHUNK_SIZE);
+    }
+}
+
+s32 dynamic_tree_alloc_node(Dynamic_Tree* tree) {
+    s32 result;
+    if (tree->free_node != TREE_NULL) {
+        result = tree->free_node;
+        tree->free_node = tree->nodes[result].parent;
+    } else {
+        assert(tree->nodes.chunks[tree->nodes_count >> ENTITY_CHUNK_SHIFT]);
+        result = tree->nodes_count++;
+    }
+    tree->nodes[result] = Dynamic_Tree_Node{ {}, TREE_NULL, TREE_NULL, TREE_NULL, -1, 0, false };
+    return result;
+}
+
+void dynamic_tree_free_node(Dynamic_Tree* tree, s32 node) {
+    tree->nodes[node].parent = tree->free_node;
+    tree->nodes[node].height = -1;
+    tree->nodes[node].moved = false;
+    tree->free_node = node;
+}
+
+// Rotates the grand child of the taller side up when a's children differ in height by more than one.
+s32 dynamic_tree_balance(Dynamic_Tree* tree, s32 ia) {
+    Dynamic_Tree_Node* a = &tree->nodes[ia];
+    if (a->entity >= 0 || a->height < 2) return ia;
+    s32 ib = a->child1;
+    s32 ic = a->child2;
+    Dynamic_Tree_Node* b = &tree->nodes[ib];
+    Dynamic_Tree_Node* c = &tree->nodes[ic];
+    s32 balance = c->height - b->height;
+    if (balance > 1 || balance < -1) {
+        // Make c the taller child, then lift it above a.
+        bool lift_c = balance > 1;
+        s32 il = lift_c ? ic : ib;
+        s32 is = lift_c ? ib : ic;
+        Dynamic_Tree_Node* l = &tree->nodes[il];
+        Dynamic_Tree_Node* sh = &tree->nodes[is];
+        s32 ix = l->child1;
+        s32 iy = l->child2;
+        Dynamic_Tree_Node* x = &tree->nodes[ix];
+        Dynamic_Tree_Node* y = &tree->nodes[iy];
+
+        l->child1 = ia;
+        l->parent = a->parent;
+        a->parent = il;
+        if (l->parent != TREE_NULL) {
+            if (tree->nodes[l->parent].child1 == ia) tree->nodes[l->parent].child1 = il;
+            else                                    tree->nodes[l->parent].child2 = il;
+        } else {
+            tree->root = il;
+        }
+
+        // The taller grand child stays under l, the other one replaces l under a.
+        s32 ikeep = x->height > y->height ? ix : iy;
+        s32 imove = x->height > y->height ? iy : ix;
+        l->child2 = ikeep;
+        if (lift_c) a->child2 = imove;
+        else        a->child1 = imove;
+        tree->nodes[imove].parent = ia;
+        a->bounds = rectf_union(sh->bounds, tree->nodes[imove].bounds);
+        l->bounds = rectf_union(a->bounds, tree->nodes[ikeep].bounds);
+        a->height = 1 + MAX(sh->height, tree->nodes[imove].height);
+        l->height = 1 + MAX(a->height, tree->nodes[ikeep].height);
+        return il;
+    }
+    return ia;
+}
+
+void dynamic_tree_insert_leaf(Dynamic_Tree* tree, s32 leaf) {
+    if (tree->root == TREE_NULL) {
+        tree->root = leaf;
+        tree->nodes[leaf].parent = TREE_NULL;
+        return;
+    }
+    Rectf leaf_bounds = tree->nodes[leaf].bounds;
+    s32 index = tree->root;
+    while (tree->nodes[index].entity < 0) {
+        Dynamic_Tree_Node* node = &tree->nodes[index];
+        f32 area = rectf_perimeter(node->bounds);
+        f32 combined_area = rectf_perimeter(rectf_union(node->bounds, leaf_bounds));
+        // Cost of making a new parent for this node and the leaf, and the cost pushed down on the children.
+        f32 cost = 2 * combined_area;
+        f32 inheritance_cost = 2 * (combined_area - area);
+        f32 child_costs[2];
+        s32 children[2] = { node->child1, node->child2 };
+        for (u32 i = 0; i < 2; ++i) {
+            Dynamic_Tree_Node* child = &tree->nodes[children[i]];
+            f32 child_area = rectf_perimeter(rectf_union(leaf_bounds, child->bounds));
+            if (child->entity < 0) child_area -= rectf_perimeter(child->bounds);
+            child_costs[i] = child_area + inheritance_cost;
+        }
+        if (cost < child_costs[0] && cost < child_costs[1]) break;
+        index = child_costs[0] < child_costs[1] ? children[0] : children[1];
+    }
+
+    s32 sibling = index;
+    s32 old_parent = tree->nodes[sibling].parent;
+    s32 new_parent = dynamic_tree_alloc_node(tree);
+    tree->nodes[new_parent].parent = old_parent;
+    tree->nodes[new_parent].bounds = rectf_union(leaf_bounds, tree->nodes[sibling].bounds);
+    tree->nodes[new_parent].height = tree->nodes[sibling].height + 1;
+    tree->nodes[new_parent].child1 = sibling;
+    tree->nodes[new_parent].child2 = leaf;
+    tree->nodes[sibling].parent = new_parent;
+    tree->nodes[leaf].parent = new_parent;
+    if (old_parent != TREE_NULL) {
+        if (tree->nodes[old_parent].child1 == sibling) tree->nodes[old_parent].child1 = new_parent;
+        else                                           tree->nodes[old_parent].child2 = new_parent;
+    } else {
+        tree->root = new_parent;
+    }
+
+    index = tree->nodes[leaf].parent;
+    while (index != TREE_NULL) {
+        index = dynamic_tree_balance(tree, index);
+        Dynamic_Tree_Node* node = &tree->nodes[index];
+        node->height = 1 + MAX(tree->nodes[node->child1].height, tree->nodes[node->child2].height);
+        node->bounds = rectf_union(tree->nodes[node->child1].bounds, tree->nodes[node->child2].bounds);
+        index = node->parent;
+    }
+}
+
+void dynamic_tree_remove_leaf(Dynamic_Tree* tree, s32 leaf) {
+    if (leaf == tree->root) {
+        tree->root = TREE_NULL;
+        return;
+    }
+    s32 parent = tree->nodes[leaf].parent;
+    s32 grand_parent = tree->nodes[parent].parent;
+    s32 sibling = tree->nodes[parent].child1 == leaf ? tree->nodes[parent].child2 : tree->nodes[parent].child1;
+    dynamic_tree_free_node(tree, parent);
+    tree->nodes[sibling].parent = grand_parent;
+    if (grand_parent == TREE_NULL) {
+        tree->root = sibling;
+        return;
+    }
+    if (tree->nodes[grand_parent].child1 == parent) tree->nodes[grand_parent].child1 = sibling;
+    else                                           tree->nodes[grand_parent].child2 = sibling;
+
+    s32 index = grand_parent;
+    while (index != TREE_NULL) {
+        index = dynamic_tree_balance(tree, index);
+        Dynamic_Tree_Node* node = &tree->nodes[index];
+        node->height = 1 + MAX(tree->nodes[node->child1].height, tree->nodes[node->child2].height);
+        node->bounds = rectf_union(tree->nodes[node->child1].bounds, tree->nodes[node->child2].bounds);
+        index = node->parent;
+    }
+}
+
+Rectf dynamic_tree_fatten(Rectf rect) {
+    return Rectf{ rect.pos, rect.radiusx + DYNAMIC_TREE_MARGIN, rect.radiusy + DYNAMIC_TREE_MARGIN };
+}
+
+void dynamic_tree_reserve(Dynamic_Tree* tree, u32 count, Arena* arena) {
+    if (count <= tree->capacity) return;
+    u32 capacity = MAX(tree->capacity * 2, ENTITY_CHUNK_SIZE);
+    while (capacity < count) capacity *= 2;
+    s32* moved = push_array_no_zero(arena, s32, capacity);
+    if (tree->moved_count) memcpy(moved, tree->moved, sizeof(s32) * tree->moved_count);
+    tree->moved = moved;
+    tree->build_keys = push_array_no_zero(arena, u64, capacity * 2);
+    tree->capacity = capacity;
+}
+
+bool dynamic_tree_attached(Dynamic_Tree* tree, s32 leaf) {
+    return leaf == tree->root || tree->nodes[leaf].parent != TREE_NULL;
+}
+
+// Spreads the low 16 bits of x over the even bits.
+u32 morton_spread(u32 x) {
+    x &= 0xFFFF;
+    x = (x | (x << 8)) & 0x00FF00FF;
+    x = (x | (x << 4)) & 0x0F0F0F0F;
+    x = (x | (x << 2)) & 0x33333333;
+    x = (x | (x << 1)) & 0x55555555;
+    return x;
+}
+
+// Leaves sorted along a Morton curve are split in halves, so the result is balanced and nearby leaves share parents.
+s32 dynamic_tree_build_range(Dynamic_Tree* tree, u64* keys, u32 count) {
+    if (count == 1) return (s32)(u32)keys[0];
+    u32 half = count / 2;
+    s32 child1 = dynamic_tree_build_range(tree, keys, half);
+    s32 child2 = dynamic_tree_build_range(tree, keys + half, count - half);
+    s32 index = dynamic_tree_alloc_node(tree);
+    Dynamic_Tree_Node* node = &tree->nodes[index];
+    node->child1 = child1;
+    node->child2 = child2;
+    node->bounds = rectf_union(tree->nodes[child1].bounds, tree->nodes[child2].bounds);
+    node->height = 1 + MAX(tree->nodes[child1].height, tree->nodes[child2].height);
+    tree->nodes[child1].parent = index;
+    tree->nodes[child2].parent = index;
+    return index;
+}
+
+// Throws the inner nodes away and builds them again over every leaf.
+void dynamic_tree_rebuild(Dynamic_Tree* tree) {
+    u64* keys = tree->build_keys;
+    u32 leaves_count = 0;
+    f32 minx = INFINITY, miny = INFINITY, maxx = -INFINITY, maxy = -INFINITY;
+    tree->free_node = TREE_NULL;
+    // Backwards, so the inner nodes are handed out from the front again.
+    for (s32 i = tree->nodes_count - 1; i >= 0; --i) {
+        Dynamic_Tree_Node* node = &tree->nodes[i];
+        if (node->height != 0) {
+            dynamic_tree_free_node(tree, i);
+            continue;
+        }
+        node->moved = false;
+        keys[leaves_count++] = (u32)i;
+        minx = MIN(minx, node->bounds.posx);
+        miny = MIN(miny, node->bounds.posy);
+        maxx = MAX(maxx, node->bounds.posx);
+        maxy = MAX(maxy, node->bounds.posy);
+    }
+    assert(leaves_count == tree->leaves_count);
+    tree->moved_count = 0;
+    tree->root = TREE_NULL;
+    if (!leaves_count) return;
+
+    f32 scalex = 65535.f / MAX(maxx - minx, 1e-6f);
+    f32 scaley = 65535.f / MAX(maxy - miny, 1e-6f);
+    for (u32 i = 0; i < leaves_count; ++i) {
+        Rectf bounds = tree->nodes[(s32)keys[i]].bounds;
+        u32 code = morton_spread((u32)((bounds.posx - minx) * scalex)) | morton_spread((u32)((bounds.posy - miny) * scaley)) << 1;
+        keys[i] |= (u64)code << 32;
+    }
+    // LSD radix sort on the code, an even number of passes so the result ends up back in keys.
+    u64* from = keys;
+    u64* to = keys + tree->capacity;
+    for (u32 shift = 32; shift < 64; shift += 8) {
+        u32 offsets[257] = {};
+        for (u32 i = 0; i < leaves_count; ++i) {
+            ++offsets[((from[i] >> shift) & 255) + 1];
+        }
+        for (u32 i = 0; i < 256; ++i) {
+            offsets[i + 1] += offsets[i];
+        }
+        for (u32 i = 0; i < leaves_count; ++i) {
+            to[offsets[(from[i] >> shift) & 255]++] = from[i];
+        }
+        u64* swap = from;
+        from = to;
+        to = swap;
+    }
+    tree->root = dynamic_tree_build_range(tree, keys, leaves_count);
+    tree->nodes[tree->root].parent = TREE_NULL;
+}
+
+// Past this share of the leaves waiting, building the tree from scratch is cheaper than reinserting them one by one.
+#define DYNAMIC_TREE_REBUILD_DIVISOR 16
+// Puts the waiting leaves in place, has to run before anything walks the tree.
+void dynamic_tree_flush(Dynamic_Tree* tree) {
+    if (!tree->moved_count) return;
+    if (tree->moved_count * DYNAMIC_TREE_REBUILD_DIVISOR >= tree->leaves_count) {
+        dynamic_tree_rebuild(tree);
+        return;
+    }
+    for (u32 i = 0; i < tree->moved_count; ++i) {
+        s32 leaf = tree->moved[i];
+        if (!tree->nodes[leaf].moved) continue;
+        tree->nodes[leaf].moved = false;
+        if (dynamic_tree_attached(tree, leaf)) dynamic_tree_remove_leaf(tree, leaf);
+        dynamic_tree_insert_leaf(tree, leaf);
+    }
+    tree->moved_count = 0;
+}
+
+void dynamic_tree_queue(Dynamic_Tree* tree, s32 leaf) {
+    if (tree->nodes[leaf].moved) return;
+    if (tree->moved_count == tree->capacity) dynamic_tree_flush(tree);
+    tree->nodes[leaf].moved = true;
+    tree->moved[tree->moved_count++] = leaf;
+}
+
+void dynamic_tree_insert(Dynamic_Tree* tree, u32 entity, Rectf rect) {
+    assert(!tree->leaf_of_entity[entity]);
+    s32 leaf = dynamic_tree_alloc_node(tree);
+    tree->nodes[leaf].bounds = dynamic_tree_fatten(rect);
+    tree->nodes[leaf].entity = entity;
+    tree->leaf_of_entity[entity] = leaf + 1;
+    ++tree->leaves_count;
+    dynamic_tree_queue(tree, leaf);
+}
+
+void dynamic_tree_remove(Dynamic_Tree* tree, u32 entity) {
+    if (!tree->leaf_of_entity[entity]) return;
+    s32 leaf = tree->leaf_of_entity[entity] - 1;
+    if (dynamic_tree_attached(tree, leaf)) dynamic_tree_remove_leaf(tree, leaf);
+    dynamic_tree_free_node(tree, leaf);
+    tree->leaf_of_entity[entity] = 0;
+    --tree->leaves_count;
+}
+
+// Returns true when the entity left its fattened box and has to be put back in place.
+bool dynamic_tree_move(Dynamic_Tree* tree, u32 entity, Rectf rect, Vec2f velocity) {
+    if (!tree->leaf_of_entity[entity]) return false;
+    s32 leaf = tree->leaf_of_entity[entity] - 1;
+    if (rectf_contains(tree->nodes[leaf].bounds, rect)) return false;
+    // Reaches as far as the entity would get over the next few frames, falling included.
+    Rectf fat = dynamic_tree_fatten(rect);
+    Rectf ahead = fat;
+    ahead.posx += velocity.x * DYNAMIC_TREE_DISPLACEMENT_FRAMES;
+    ahead.posy += velocity.y * DYNAMIC_TREE_DISPLACEMENT_FRAMES - GRAVITY * DYNAMIC_TREE_DISPLACEMENT_FRAMES * DYNAMIC_TREE_DISPLACEMENT_FRAMES / 2;
+    tree->nodes[leaf].bounds = rectf_union(fat, ahead);
+    dynamic_tree_queue(tree, leaf);
+    return true;
+}
+
+// The entity in slot from now lives in slot to.
+void dynamic_tree_relabel(Dynamic_Tree* tree, u32 from, u32 to) {
+    tree->leaf_of_entity[to] = tree->leaf_of_entity[from];
+    tree->leaf_of_entity[from] = 0;
+    if (tree->leaf_of_entity[to]) tree->nodes[tree->leaf_of_entity[to] - 1].entity = to;
+}
+
+// Pushes the entities whose fattened box overlaps rect, one u32 each.
+u32 dynamic_tree_query(Dynamic_Tree* tree, Rectf rect, Arena* arena, Broadphase_Stats* stats) {
+    dynamic_tree_flush(tree);
+    u32 results_count = 0;
+    u32 nodes_tested = 0;
+    s32 stack[64];
+    u32 stack_count = 0;
+    if (tree->root != TREE_NULL) stack[stack_count++] = tree->root;
+    while (stack_count) {
+        Dynamic_Tree_Node* node = &tree->nodes[stack[--stack_count]];
+        ++nodes_tested;
+        if (!check_collided(rect, node->bounds)) continue;
+        if (node->entity >= 0) {
+            *push_struct_no_zero(arena, u32) = node->entity;
+            ++results_count;
+        } else {
+            assert(stack_count + 2 <= 64);
+            stack[stack_count++] = node->child1;
+            stack[stack_count++] = node->child2;
+        }
+    }
+    stats->pairs_tested += nodes_tested;
+    return results_count;
+}
+
+//
+// Spatial queries
+// Level geometry comes from the static layer and everything else from the dynamic tree, so the cost follows how much is
+// near the query rather than how big the level is. Results are slots in no particular order, contiguous at *results.
+// The candidates that didn't make it stay pushed after them until the caller ends its scope.
+u32 query_rect(Broadphase_State* broadphase, Entity_Store* entities, Rectf rect, Entity_Type_Flag types, Arena* scratch, u32** results) {
+    u32* candidates = push_array_no_zero(scratch, u32, 0);
+    u32 candidates_count = 0;
+    if (types & ~STATIC_LAYER_TYPES) {
+        candidates_count += dynamic_tree_query(&broadphase->dynamic_tree, rect, scratch, &broadphase->stats);
+    }
+    if (types & ENTITY_STATIC) {
+        candidates_count += static_tree_query(&broadphase->statics.solids, rect, scratch);
+    }
+    if (types & ENTITY_SPIKE) {
+        candidates_count += static_tree_query(&broadphase->statics.spikes, rect, scratch);
+    }
+    u32 results_count = 0;
+    for (u32 i = 0; i < candidates_count; ++i) {
+        u32 index = candidates[i];
+        if (!(entities->type[index] & types) || !check_collided(rect, entity_rect(entities, index))) continue;
+        candidates[results_count++] = index;
+    }
+    *results = candidates;
+    return results_count;
+}
+
+u32 query_point(Broadphase_State* broadphase, Entity_Store* entities, Vec2f point, Entity_Type_Flag types, Arena* scratch, u32** results) {
+    return query_rect(broadphase, entities, Rectf{ point, 0, 0 }, types, scratch, results);
+}
+
+// Where from + t * delta enters rect for t in [0, 1], 0 when it starts inside. Like check_collided,
+// only touching the border doesn't count.
+bool segment_enters_rect(Vec2f from, Vec2f delta, Rectf rect, f32* t) {
+    f32 enter = 0;
+    f32 exit  = 1;
+    for (u32 axis = 0; axis < 2; ++axis) {
+        f32 min = rect.pos.a[axis] - rect.radius.a[axis];
+        f32 max = rect.pos.a[axis] + rect.radius.a[axis];
+        if (delta.a[axis] == 0) {
+            if (from.a[axis] <= min || from.a[axis] >= max) return false;
+            continue;
+        }
+        f32 t0 = (min - from.a[axis]) / delta.a[axis];
+        f32 t1 = (max - from.a[axis]) / delta.a[axis];
+        enter = MAX(enter, MIN(t0, t1));
+        exit  = MIN(exit,  MAX(t0, t1));
+        if (enter >= exit) return false;
+    }
+    *t = enter;
+    return true;
+}
+
+void raycast_against(Entity_Store* entities, u32 index, Vec2f from, Vec2f delta, Entity_Type_Flag types, Raycast_Hit* hit, bool* found) {
+    f32 t;
+    if (!(entities->type[index] & types) || !segment_enters_rect(from, delta, entity_rect(entities, index), &t)) return;
+    if (!*found || t < hit->t || (t == hit->t && index < hit->index)) {
+        *hit = Raycast_Hit{ index, t };
+        *found = true;
+    }
+}
+
+void raycast_static_tree(Static_Tree* tree, Entity_Store* entities, Vec2f from, Vec2f delta, Entity_Type_Flag types, Raycast_Hit* hit, bool* found) {
+    f32 t;
+    u32 stack[64];
+    u32 stack_count = 0;
+    if (tree->nodes_count) stack[stack_count++] = 0;
+    while (stack_count) {
+        Static_Tree_Node* node = tree->nodes + stack[--stack_count];
+        if (!segment_enters_rect(from, delta, node->bounds, &t) || (*found && t > hit->t)) continue;
+        if (node->count) {
+            for (u32 i = 0; i < node->count; ++i) {
+                raycast_against(entities, tree->leaf_entities[node->first + i], from, delta, types, hit, found);
+            }
+        } else {
+            assert(stack_count + 2 <= 64);
+            stack[stack_count++] = node->first;
+            stack[stack_count++] = node->first + 1;
+        }
+    }
+}
+
+// First rect of the given types along the segment, equally close ones resolve to the lowest slot.
+bool raycast(Broadphase_State* broadphase, Entity_Store* entities, Vec2f from, Vec2f to, Entity_Type_Flag types, Raycast_Hit* hit) {
+    Vec2f delta = { to.x - from.x, to.y - from.y };
+    bool found = false;
+    f32 t;
+    if (types & ~STATIC_LAYER_TYPES) {
+        Dynamic_Tree* tree = &broadphase->dynamic_tree;
+        dynamic_tree_flush(tree);
+        s32 stack[64];
+        u32 stack_count = 0;
+        if (tree->root != TREE_NULL) stack[stack_count++] = tree->root;
+        while (stack_count) {
+            Dynamic_Tree_Node* node = &tree->nodes[stack[--stack_count]];
+            if (!segment_enters_rect(from, delta, node->bounds, &t) || (found && t > hit->t)) continue;
+            if (node->entity >= 0) {
+                raycast_against(entities, node->entity, from, delta, types, hit, &found);
+            } else {
+                assert(stack_count + 2 <= 64);
+                stack[stack_count++] = node->child1;
+                stack[stack_count++] = node->child2;
+            }
+        }
+    }
+    if (types & ENTITY_STATIC) raycast_static_tree(&broadphase->statics.solids, entities, from, delta, types, hit, &found);
+    if (types & ENTITY_SPIKE)  raycast_static_tree(&broadphase->statics.spikes, entities, from, delta, types, hit, &found);
+    return found;
 }
 
 const f32 PLAYER_MOVE_SPEED = .1f;
 const f32 COLLISION_EPSILON = .001f;
-Rectf try_move_axis(Rectf mover, f32 move_axis, Axis axis_offset, Entity* others, u32 others_count, Collision_Info* info) {
+// A static stops the mover if the mover ends up inside it, or if the mover's leading edge passes the static's near edge
+// during the move, so thin statics can't be skipped over by a large step. Statics the mover already overlapped at the
+// start only count when it still overlaps them at the end, same as before.
+// Equally close edges resolve to the lowest slot, so the result doesn't depend on the order others are visited in.
+// swept is the box try_move_axis culls with. Testing it here too means every static query path rejects exactly the
+// same rects, the tree and sweep paths just never get to the ones it culls.
+void try_move_against(Rectf start, Rectf mover, Rectf swept, Axis axis_offset, f32 sign, Entity_Store* others, u32 other_index, f32* most_extreme_edge, s32* hit_index) {
+    if (others->type[other_index] != ENTITY_STATIC) return;
+    Rectf other = entity_rect(others, other_index);
+    if (!check_collided(swept, other)) return;
+    f32 edge = other.pos.a[axis_offset] - other.radius.a[axis_offset] * sign;
+    if (!check_collided(mover, other)) {
+        u32 cross = 1 - axis_offset;
+        f32 cross_overlap = mover.radius.a[cross] + other.radius.a[cross] - fabsf(mover.pos.a[cross] - other.pos.a[cross]);
+        f32 start_edge = start.pos.a[axis_offset] + start.radius.a[axis_offset] * sign;
+        f32 end_edge   = mover.pos.a[axis_offset] + mover.radius.a[axis_offset] * sign;
+        bool crossed = edge * sign >= start_edge * sign && edge * sign < end_edge * sign;
+        if (cross_overlap <= 0 || !crossed) return;
+    }
+    bool closer = edge * sign < *most_extreme_edge * sign;
+    bool tied   = edge == *most_extreme_edge && *hit_index >= 0 && (s32)other_index < *hit_index;
+    if (closer || tied) {
+        *most_extreme_edge = edge;
+        *hit_index = other_index;
+    }
+}
+
+//
+// Tile map
+s32 tile_map_size(Axis axis) {
+    return axis == AXIS_X ? TILE_MAP_WIDTH : TILE_MAP_HEIGHT;
+}
+
+Tile tile_map_get(Tile_Map* map, s32 x, s32 y) {
+    if (x < 0 || y < 0 || x >= TILE_MAP_WIDTH || y >= TILE_MAP_HEIGHT) return TILE_EMPTY;
+    return (Tile)map->tiles[y * TILE_MAP_WIDTH + x];
+}
+
+// Tiles along axis whose inside overlaps (min, max), clamped to the map. Empty when *first > *last.
+void tile_map_span(Tile_Map* map, Axis axis, f32 min, f32 max, s32* first, s32* last) {
+    f32 origin = map->origin.a[axis];
+    *first = MAX((s32)floorf((min - origin) / TILE_SIZE), 0);
+    *last  = MIN((s32)ceilf((max - origin) / TILE_SIZE) - 1, tile_map_size(axis) - 1);
+}
+
+// Sets every tile whose center lies in [min, max) of the rect, or the one under its center if it's thinner than a tile.
+void tile_map_fill(Tile_Map* map, Rectf rect, Tile tile) {
+    s32 first[2];
+    s32 last[2];
+    for (u32 axis = 0; axis < 2; ++axis) {
+        f32 origin = map->origin.a[axis];
+        first[axis] = (s32)ceilf((rect.pos.a[axis] - rect.radius.a[axis] - origin) / TILE_SIZE - .5f);
+        last[axis]  = (s32)ceilf((rect.pos.a[axis] + rect.radius.a[axis] - origin) / TILE_SIZE - .5f) - 1;
+        if (first[axis] > last[axis]) {
+            first[axis] = last[axis] = (s32)floorf((rect.pos.a[axis] - origin) / TILE_SIZE);
+        }
+        first[axis] = MAX(first[axis], 0);
+        last[axis]  = MIN(last[axis], tile_map_size((Axis)axis) - 1);
+    }
+    for (s32 y = first[AXIS_Y]; y <= last[AXIS_Y]; ++y) {
+        for (s32 x = first[AXIS_X]; x <= last[AXIS_X]; ++x) {
+            map->tiles[y * TILE_MAP_WIDTH + x] = tile;
+        }
+    }
+}
+
+// Whether rect is made of whole tiles inside the map, the only rects that come back unchanged from the tiles.
+bool tile_map_fits(Tile_Map* map, Rectf rect) {
+    for (u32 axis = 0; axis < 2; ++axis) {
+        f32 first = (rect.pos.a[axis] - rect.radius.a[axis] - map->origin.a[axis]) / TILE_SIZE;
+        f32 last  = (rect.pos.a[axis] + rect.radius.a[axis] - map->origin.a[axis]) / TILE_SIZE;
+        if (first != floorf(first) || last != floorf(last)) return false;
+        if (first < 0 || last <= first || last > tile_map_size((Axis)axis)) return false;
+    }
+    return true;
+}
+
+bool tile_map_overlaps(Tile_Map* map, Rectf rect, Tile tile) {
+    s32 minx, maxx, miny, maxy;
+    tile_map_span(map, AXIS_X, rect.posx - rect.radiusx, rect.posx + rect.radiusx, &minx, &maxx);
+    tile_map_span(map, AXIS_Y, rect.posy - rect.radiusy, rect.posy + rect.radiusy, &miny, &maxy);
+    for (s32 y = miny; y <= maxy; ++y) {
+        for (s32 x = minx; x <= maxx; ++x) {
+            if (map->tiles[y * TILE_MAP_WIDTH + x] == tile) return true;
+        }
+    }
+    return false;
+}
+
+// Next horizontal run of equal non empty tiles at or after *cursor, as a rect. Used to save and draw the map.
+bool tile_map_next_run(Tile_Map* map, u32* cursor, Tile* tile, Rectf* rect) {
+    while (*cursor < TILE_MAP_WIDTH * TILE_MAP_HEIGHT) {
+        u32 start = (*cursor)++;
+        *tile = (Tile)map->tiles[start];
+        if (*tile == TILE_EMPTY) continue;
+        u32 row_end = (start / TILE_MAP_WIDTH + 1) * TILE_MAP_WIDTH;
+        while (*cursor < row_end && map->tiles[*cursor] == *tile) ++*cursor;
+        f32 width = (*cursor - start) * TILE_SIZE;
+        rect->posx    = map->origin.x + (start % TILE_MAP_WIDTH) * TILE_SIZE + width / 2;
+        rect->posy    = map->origin.y + (start / TILE_MAP_WIDTH + .5f) * TILE_SIZE;
+        rect->radiusx = width / 2;
+        rect->radiusy = TILE_SIZE / 2;
+        return true;
+    }
+    return false;
+}
+
+// Same rules as try_move_against, but only the rows of tiles the mover's leading edge can reach are walked.
+// Returns whether a solid tile stops the mover, *edge is the near side of the first one.
+bool tile_map_move(Tile_Map* map, Rectf start, Rectf mover, Axis axis, f32 sign, f32* edge) {
+    Axis cross = (Axis)(1 - axis);
+    s32 cross_first, cross_last;
+    tile_map_span(map, cross, mover.pos.a[cross] - mover.radius.a[cross], mover.pos.a[cross] + mover.radius.a[cross], &cross_first, &cross_last);
+    if (cross_first > cross_last) return false;
+
+    f32 origin     = map->origin.a[axis];
+    f32 start_edge = (start.pos.a[axis] + start.radius.a[axis] * sign - origin) / TILE_SIZE;
+    f32 end_edge   = (mover.pos.a[axis] + mover.radius.a[axis] * sign - origin) / TILE_SIZE;
+    f32 end_back   = (mover.pos.a[axis] - mover.radius.a[axis] * sign - origin) / TILE_SIZE;
+    s32 first, last;
+    if (sign > 0) {
+        first = MAX(MIN((s32)floorf(end_back), (s32)ceilf(start_edge)), 0);
+        last  = MIN((s32)ceilf(end_edge) - 1, tile_map_size(axis) - 1);
+    } else {
+        first = MIN(MAX((s32)ceilf(end_back) - 1, (s32)floorf(start_edge) - 1), tile_map_size(axis) - 1);
+        last  = MAX((s32)floorf(end_edge), 0);
+    }
+    s32 step = sign > 0 ? 1 : -1;
+    for (s32 k = first; k * step <= last * step; k += step) {
+        for (s32 c = cross_first; c <= cross_last; ++c) {
+            Tile tile = axis == AXIS_X ? tile_map_get(map, k, c) : tile_map_get(map, c, k);
+            if (tile != TILE_SOLID) continue;
+            *edge = origin + (sign > 0 ? k : k + 1) * TILE_SIZE;
+            return true;
+        }
+    }
+    return false;
+}
+
+Rectf try_move_axis(Rectf mover, f32 move_axis, Axis axis_offset, Entity_Store* others, Broadphase_State* broadphase, Collision_Info* info) {
+    u32 others_count = others->count;
     if (move_axis != 0) {
         f32 sign;
         if (move_axis > 0) {
@@ -138,20 +1308,87 @@ Rectf try_move_axis(Rectf mover, f32 move_axis, Axis axis_offset, Entity* others
         } else {
             sign = -1.f;
         }
-        mover.pos.a[axis_offset] += move_axis;
-        f32 most_extreme_edge = mover.pos.a[axis_offset] + mover.radius.a[axis_offset] * sign;
-        for (u32 i = 0; i < others_count; ++i) {
-            Entity other = others[i];
-            if (other.type != ENTITY_STATIC || !check_collided(mover, other.rect)) continue;
-            f32 edge = other.pos.a[axis_offset] - other.radius.a[axis_offset] * sign;
-            if (edge * sign < most_extreme_edge * sign) {
-                most_extreme_edge = edge;
-                if (sign > 0) info->sides_touched |= (DIR_RIGHT >> axis_offset);
-                else          info->sides_touched |= (DIR_LEFT  >> axis_offset);
-                info->other_index = i;
+        Rectf start = mover;
+        // mover is only written by name, through pos.a[axis_offset] it goes to the stack and reading it back whole
+        // right after stalls, on every call.
+        f32 radius = start.radius.a[axis_offset];
+        f32 pos = start.pos.a[axis_offset] + move_axis;
+        if (axis_offset == AXIS_X) mover.posx = pos;
+        else                       mover.posy = pos;
+        // Everything the mover touches on the way lies inside the swept box.
+        Rectf swept = rectf_union(start, mover);
+        f32 most_extreme_edge = pos + radius * sign;
+        s32 hit_index = -1;
+        if (broadphase->static_query == STATIC_QUERY_TREE) {
+            Static_Tree* tree = &broadphase->statics.solids;
+            u32 stack[64];
+            u32 stack_count = 0;
+            if (tree->nodes_count) stack[stack_count++] = 0;
+            while (stack_count) {
+                Static_Tree_Node* node = tree->nodes + stack[--stack_count];
+                ++broadphase->stats.move_rects_tested;
+                if (!check_collided(swept, node->bounds)) continue;
+                if (node->count) {
+                    broadphase->stats.move_rects_tested += node->count;
+                    u32 mask = overlap_mask_4(swept, static_tree_rects(tree), node->first) & ((1 << node->count) - 1);
+                    while (mask) {
+                        u32 other_index = tree->leaf_entities[node->first + count_trailing_zeros(mask)];
+                        mask &= mask - 1;
+                        if (other_index >= others_count) continue;
+                        try_move_against(start, mover, swept, axis_offset, sign, others, other_index, &most_extreme_edge, &hit_index);
+                    }
+                } else {
+                    assert(stack_count + 2 <= 64);
+                    stack[stack_count++] = node->first;
+                    stack[stack_count++] = node->first + 1;
+                }
+            }
+        } else if (broadphase->static_query == STATIC_QUERY_SWEEP) {
+            Sweep_And_Prune* sweep = &broadphase->statics.solids_sweep;
+            // The left edges in the order are rounded, the range reaches a little further and try_move_against decides.
+            f32 slack = 2 * float_step(2 * (fabsf(swept.posx) + swept.radiusx + sweep->max_width));
+            u32 begin = sweep_lower_bound(sweep, swept.posx - swept.radiusx - sweep->max_width - slack);
+            u32 end   = sweep_lower_bound(sweep, swept.posx + swept.radiusx + slack);
+            broadphase->stats.move_rects_tested += end - begin;
+            // In batches, masks for the whole store would make this a 16KB stack frame on every call, whichever path it takes.
+            #define SWEEP_MASKS_BATCH 256
+            for (u32 batch = begin; batch < end; batch += SWEEP_MASKS_BATCH) {
+                u8 masks[SWEEP_MASKS_BATCH / 8];
+                u32 masks_count = overlap_masks(swept, sweep_rects(sweep), batch, MIN(batch + SWEEP_MASKS_BATCH, end), masks);
+                for (u32 m = 0; m < masks_count; ++m) {
+                    u32 mask = masks[m];
+                    while (mask) {
+                        u32 other_index = sweep->order[batch + m * 8 + count_trailing_zeros(mask)];
+                        mask &= mask - 1;
+                        if (other_index >= others_count) continue;
+                        try_move_against(start, mover, swept, axis_offset, sign, others, other_index, &most_extreme_edge, &hit_index);
+                    }
+                }
             }
+        } else {
+            broadphase->stats.move_rects_tested += others_count;
+            for (u32 i = 0; i < others_count; ++i) {
+                try_move_against(start, mover, swept, axis_offset, sign, others, i, &most_extreme_edge, &hit_index);
+            }
+        }
+        bool hit = hit_index >= 0;
+        // Tiles only win when strictly closer, so a tied entity can still be stood on.
+        f32 tile_edge;
+        if (broadphase->tile_map.active && tile_map_move(&broadphase->tile_map, start, mover, axis_offset, sign, &tile_edge) &&
+            tile_edge * sign < most_extreme_edge * sign)
+        {
+            most_extreme_edge = tile_edge;
+            hit_index = -1;
+            hit = true;
         }
-        mover.pos.a[axis_offset] = most_extreme_edge - (mover.radius.a[axis_offset] + COLLISION_EPSILON) * sign;
+        if (hit) {
+            if (sign > 0) info->sides_touched |= (DIR_RIGHT >> axis_offset);
+            else          info->sides_touched |= (DIR_LEFT  >> axis_offset);
+            info->other_index = hit_index;
+        }
+        pos = most_extreme_edge - (radius + COLLISION_EPSILON) * sign;
+        if (axis_offset == AXIS_X) mover.posx = pos;
+        else                       mover.posy = pos;
     }
     return mover;
 }
@@ -169,84 +1406,350 @@ s8 direction_to_int(Direction dir) {
     }
 }
 
-Entity* create_entity(Game_Info* frame) {
-    u16 found_index;
+Entity_Table* entity_table(Entity_Store* entities, Entity_Type type) {
+    assert(type != ENTITY_NONE && type < (1 << ENTITY_TYPE_COUNT));
+    return entities->tables + count_trailing_zeros(type);
+}
+
+// Pushes the slots of every type in types, table by table. Loops that only want some types walk these instead of the store.
+u32 gather_slots(Entity_Store* entities, Entity_Type_Flag types, Arena* arena, u32** slots) {
+    *slots = push_array_no_zero(arena, u32, 0);
+    u32 count = 0;
+    for (u32 t = 0; t < ENTITY_TYPE_COUNT; ++t) {
+        if (!(types & (1 << t))) continue;
+        Entity_Table* table = entities->tables + t;
+        u32* gathered = push_array_no_zero(arena, u32, table->count);
+        for (u32 i = 0; i < table->count; ++i) gathered[i] = table->slots[i];
+        count += table->count;
+    }
+    return count;
+}
+
+#define TAKE_CHUNK(array, chunk, arena) \
+    ((array).chunks[chunk] = push_array_aligned(arena, decltype(array)::Item, ENTITY_CHUNK_SIZE, CACHE_LINE_SIZE))
+
+//
+// Components
+
+// Index + 1 of the slot's item, 0 if it doesn't have one.
+u32 sparse_set_find(Sparse_Set* set, u32 slot) {
+    u32* chunk = set->dense_of_slot.chunks[slot >> ENTITY_CHUNK_SHIFT];
+    return chunk ? chunk[slot & (ENTITY_CHUNK_SIZE - 1)] : 0;
+}
+
+// Returns where the slot's item goes, COMPONENT_ADD takes the chunk for it.
+u32 sparse_set_insert(Sparse_Set* set, u32 slot, Arena* arena) {
+    assert(!sparse_set_find(set, slot));
+    u32 dense = set->count++;
+    if (!set->dense_of_slot.chunks[slot >> ENTITY_CHUNK_SHIFT]) TAKE_CHUNK(set->dense_of_slot, slot >> ENTITY_CHUNK_SHIFT, arena);
+    if (!set->slots.chunks[dense >> ENTITY_CHUNK_SHIFT])        TAKE_CHUNK(set->slots, dense >> ENTITY_CHUNK_SHIFT, arena);
+    set->dense_of_slot[slot] = dense + 1;
+    set->slots[dense] = slot;
+    return dense;
+}
+
+// Moves the last slot into the slot's place and returns that index, the item at count has to follow it.
+// Returns count if the slot doesn't have the component.
+u32 sparse_set_erase(Sparse_Set* set, u32 slot) {
+    u32 found = sparse_set_find(set, slot);
+    if (!found) return set->count;
+    u32 last = set->slots[--set->count];
+    set->slots[found - 1] = last;
+    set->dense_of_slot[last] = found;
+    set->dense_of_slot[slot] = 0;
+    return found - 1;
+}
+
+// For compaction, to has to be free.
+void sparse_set_relabel(Sparse_Set* set, u32 from, u32 to, Arena* arena) {
+    u32 found = sparse_set_find(set, from);
+    if (!found) return;
+    if (!set->dense_of_slot.chunks[to >> ENTITY_CHUNK_SHIFT]) TAKE_CHUNK(set->dense_of_slot, to >> ENTITY_CHUNK_SHIFT, arena);
+    set->dense_of_slot[from] = 0;
+    set->dense_of_slot[to] = found;
+    set->slots[found - 1] = to;
+}
+
+// Walks the items, not the slots, so clearing a set few entities are in is cheap.
+void sparse_set_clear(Sparse_Set* set) {
+    for (u32 i = 0; i < set->count; ++i) {
+        set->dense_of_slot[set->slots[i]] = 0;
+    }
+    set->count = 0;
+}
+
+// The item of a slot, NULL if it doesn't have the component.
+#define COMPONENT_GET(component, slot) \
+    (sparse_set_find(&(component).set, slot) ? &(component).items[sparse_set_find(&(component).set, slot) - 1] : NULL)
+
+// Returns the slot's new item, zeroed.
+#define COMPONENT_ADD(component, slot, arena) \
+    ((component).items.chunks[(component).set.count >> ENTITY_CHUNK_SHIFT] ? 0 : TAKE_CHUNK((component).items, (component).set.count >> ENTITY_CHUNK_SHIFT, arena),\
+     &((component).items[sparse_set_insert(&(component).set, slot, arena)] = {}))
+
+// Does nothing if the slot doesn't have the component.
+#define COMPONENT_REMOVE(component, slot) \
+    do {\
+        u32 hole_ = sparse_set_erase(&(component).set, slot);\
+        if (hole_ < (component).set.count) (component).items[hole_] = (component).items[(component).set.count];\
+    } while (0)
+
+// Takes the next chunk of every array indexed by slot, what's already in them stays where it is.
+void grow_entity_chunks(Game_Info* game_info) {
+    Entity_Store* entities = &game_info->entities;
+    Broadphase_State* broadphase = &game_info->broadphase;
+    Arena* arena = game_info->persistent_arena;
+    u32 chunk = entities->chunks_count++;
+    assert(chunk < ENTITY_CHUNKS_CAPACITY);
+    TAKE_CHUNK(entities->type,         chunk, arena);
+    TAKE_CHUNK(entities->rect,         chunk, arena);
+    TAKE_CHUNK(entities->velocity,     chunk, arena);
+    TAKE_CHUNK(entities->cold,         chunk, arena);
+    TAKE_CHUNK(entities->grounded,     chunk, arena);
+    TAKE_CHUNK(entities->standing_on,  chunk, arena);
+    TAKE_CHUNK(entities->still_frames, chunk, arena);
+    TAKE_CHUNK(entities->asleep,       chunk, arena);
+    TAKE_CHUNK(entities->generation,   chunk, arena);
+    TAKE_CHUNK(entities->table_index,  chunk, arena);
+    TAKE_CHUNK(entities->journal_mark, chunk, arena);
+    for (u32 i = 0; i < ENTITY_TYPE_COUNT; ++i) {
+        TAKE_CHUNK(entities->tables[i].slots, chunk, arena);
+    }
+    TAKE_CHUNK(game_info->empty_entities, chunk, arena);
+    TAKE_CHUNK(game_info->commands.creates, chunk, arena);
+    TAKE_CHUNK(game_info->commands.deletes, chunk, arena);
+    TAKE_CHUNK(broadphase->pair_cache.types, chunk, arena);
+    TAKE_CHUNK(broadphase->pair_cache.rects, chunk, arena);
+    TAKE_CHUNK(broadphase->dynamic_tree.leaf_of_entity, chunk, arena);
+    TAKE_CHUNK(broadphase->dynamic_tree.nodes, 2 * chunk,     arena);
+    TAKE_CHUNK(broadphase->dynamic_tree.nodes, 2 * chunk + 1, arena);
+    sweep_and_prune_reserve(&broadphase->sweep, entities->chunks_count * ENTITY_CHUNK_SIZE, arena);
+    sweep_and_prune_reserve(&broadphase->statics.solids_sweep, entities->chunks_count * ENTITY_CHUNK_SIZE, arena);
+    dynamic_tree_reserve(&broadphase->dynamic_tree, entities->chunks_count * ENTITY_CHUNK_SIZE, arena);
+}
+
+// Writes the entity into a free slot, or a new one, but leaves it out of the tables and the broadphase.
+u32 take_entity_slot(Game_Info* frame, Entity initial) {
+    Entity_Store* entities = &frame->entities;
+    u32 slot;
     if (frame->empty_entities_count) {
-        found_index = frame->empty_entities[--frame->empty_entities_count];
+        slot = frame->empty_entities[--frame->empty_entities_count];
     } else {
-        assert(frame->entities_count < ENTITIES_CAPACITY);
-        found_index = frame->entities_count++;
+        if (entities->count == entities->chunks_count * ENTITY_CHUNK_SIZE) grow_entity_chunks(frame);
+        slot = entities->count++;
+    }
+    if (!entities->generation[slot]) next_generation(entities, slot);
+    journal_record(entities, slot, JOURNAL_CREATED);
+    set_entity(entities, slot, initial);
+    return slot;
+}
+
+// Adds an entity written by take_entity_slot to its table, the broadphase and its components.
+void link_entity(Game_Info* frame, u32 slot) {
+    Entity_Store* entities = &frame->entities;
+    Entity_Type type = entities->type[slot];
+    Entity_Table* table = entity_table(entities, type);
+    entities->table_index[slot] = table->count;
+    table->slots[table->count++] = slot;
+    if (!(type & STATIC_LAYER_TYPES)) {
+        dynamic_tree_insert(&frame->broadphase.dynamic_tree, slot, entity_rect(entities, slot));
+    }
+    if (type == ENTITY_DOOR) COMPONENT_ADD(entities->doors, slot, frame->persistent_arena);
+}
+
+const f32 CULL_OBJECT_IF_SMALLER = .2;
+// Takes the whole entity up front so the broadphase sees its type and rect from the start.
+// Takes effect right away, for loading and the editor. Updates use defer_create_entity.
+// Returns 0 for ENTITY_NONE and for rects too small to be anything but a misclick in the editor.
+Entity_Handle create_entity(Game_Info* frame, Entity initial) {
+    if (initial.type == ENTITY_NONE) return 0;
+    if (initial.radiusx < CULL_OBJECT_IF_SMALLER || initial.radiusy < CULL_OBJECT_IF_SMALLER) return 0;
+    Entity_Store* entities = &frame->entities;
+    u32 slot = take_entity_slot(frame, initial);
+    link_entity(frame, slot);
+    return entity_handle(entities, slot);
+}
+
+// Takes effect right away, updates use defer_delete_entity.
+void delete_entity(Game_Info* game_info, u32 slot) {
+    Entity_Store* entities = &game_info->entities;
+    if (entities->type[slot] == ENTITY_NONE) return;
+    Entity_Table* table = entity_table(entities, entities->type[slot]);
+    u32 last = table->slots[--table->count];
+    table->slots[entities->table_index[slot]] = last;
+    entities->table_index[last] = entities->table_index[slot];
+    journal_record(entities, slot, JOURNAL_DELETED);
+    entities->type[slot] = ENTITY_NONE;
+    // overlap_entities doesn't walk empty slots, whatever is created here next has to look changed to it.
+    Pair_Cache* cache = &game_info->broadphase.pair_cache;
+    cache->types[slot] = ENTITY_NONE;
+    cache->rects[slot] = {};
+    next_generation(entities, slot);
+    game_info->empty_entities[game_info->empty_entities_count++] = slot;
+    dynamic_tree_remove(&game_info->broadphase.dynamic_tree, slot);
+    COMPONENT_REMOVE(entities->doors, slot);
+}
+
+// Like create_entity, but the entity only shows up once apply_entity_commands runs. The handle is good right away.
+Entity_Handle defer_create_entity(Game_Info* game_info, Entity initial) {
+    if (initial.type == ENTITY_NONE) return 0;
+    if (initial.radiusx < CULL_OBJECT_IF_SMALLER || initial.radiusy < CULL_OBJECT_IF_SMALLER) return 0;
+    Entity_Store* entities = &game_info->entities;
+    Entity_Commands* commands = &game_info->commands;
+    u32 slot = take_entity_slot(game_info, initial);
+    entities->type[slot] = ENTITY_NONE;
+    commands->creates[commands->creates_count++] = Deferred_Create{ slot, initial.type };
+    return entity_handle(entities, slot);
+}
+
+// The entity stays in the store, its table and the broadphase until apply_entity_commands runs.
+void defer_delete_entity(Game_Info* game_info, u32 slot) {
+    Entity_Commands* commands = &game_info->commands;
+    assert(commands->deletes_count < game_info->entities.count);
+    commands->deletes[commands->deletes_count++] = slot;
+}
+
+// Creates go first, so an entity created and deleted in the same frame ends up deleted.
+// Deleting a slot twice only deletes it once.
+void apply_entity_commands(Game_Info* game_info) {
+    Entity_Store* entities = &game_info->entities;
+    Entity_Commands* commands = &game_info->commands;
+    for (u32 i = 0; i < commands->creates_count; ++i) {
+        Deferred_Create create = commands->creates[i];
+        entities->type[create.slot] = create.type;
+        link_entity(game_info, create.slot);
+    }
+    for (u32 i = 0; i < commands->deletes_count; ++i) {
+        delete_entity(game_info, commands->deletes[i]);
+    }
+    commands->creates_count = 0;
+    commands->deletes_count = 0;
+}
+
+// Call after writing an entity's rect.
+void entity_moved(Broadphase_State* broadphase, Entity_Store* entities, u32 slot) {
+    if (dynamic_tree_move(&broadphase->dynamic_tree, slot, entity_rect(entities, slot), entities->velocity[slot])) {
+        ++broadphase->stats.tree_reinserts;
     }
-    Entity* result = frame->entities + found_index;
-    *result = {};
-    return result;
 }
 
 void attack(Player* player, Game_Info* frame) {
-    Entity* attack = create_entity(frame);
-    *attack = {};
-    attack->type = ENTITY_PLAYER_ATTACK;
-    attack->rect = { player->e->posx + (player->e->radiusx * direction_to_int(player->e->facing)), player->e->posy, .8f, .4f };
-    attack->facing = player->e->facing;
-    player->attack = attack;
+    Entity_Store* entities = &frame->entities;
+    u32 e = handle_slot(player->e);
+    Entity attack = {};
+    attack.type = ENTITY_PLAYER_ATTACK;
+    attack.rect = { entities->rect[e].posx + (entities->rect[e].radiusx * direction_to_int(entities->cold[e].facing)), entities->rect[e].posy, .8f, .4f };
+    attack.facing = entities->cold[e].facing;
+    player->attack = defer_create_entity(frame, attack);
 }
 
 void throw_projectile(Rectf player, Game_Info* frame) {
-    Entity* proj = create_entity(frame);
-    *proj = {};
-    proj->type = ENTITY_PROJECTILE;
-    proj->rect = { player.pos, .3f, .3f };
-    proj->velocity = { .3, .30 };
+    Entity proj = {};
+    proj.type = ENTITY_PROJECTILE;
+    proj.rect = { player.pos, .3f, .3f };
+    proj.velocity = { .3, .30 };
+    defer_create_entity(frame, proj);
+}
+
+// Stress test for the entity store, a block of projectiles above the player flung in a spread of directions.
+void spawn_projectiles(Game_Info* game_info, u32 count) {
+    Rectf player = entity_rect(&game_info->entities, handle_slot(game_info->player.e));
+    count = MIN(count, ENTITIES_CAPACITY - game_info->entities.count + game_info->empty_entities_count);
+    #define SPAWN_COLUMNS 400
+    for (u32 i = 0; i < count; ++i) {
+        u32 column = i % SPAWN_COLUMNS;
+        u32 row    = i / SPAWN_COLUMNS;
+        Entity projectile = {};
+        projectile.type = ENTITY_PROJECTILE;
+        projectile.rect = { player.posx + (column - SPAWN_COLUMNS / 2.f) * .7f, player.posy + 2 + row * .7f, .3f, .3f };
+        projectile.velocity = { ((s32)(i * 7 % 11) - 5) * .02f, (i * 13 % 7) * .03f };
+        defer_create_entity(game_info, projectile);
+    }
 }
 
-void update_launched(Entity* object, Entity* others, u32 others_count) {
-    object->velocity.y -= GRAVITY;
+void update_launched(u32 object, Entity_Store* others, Broadphase_State* broadphase) {
+    Vec2f* velocity = &others->velocity[object];
+    velocity->y -= GRAVITY;
     Collision_Info collision = {};
-    object->rect = try_move_axis(object->rect, object->velocity.y, AXIS_Y, others, others_count, &collision);
-    object->rect = try_move_axis(object->rect, object->velocity.x, AXIS_X, others, others_count, &collision);
+    Rectf rect = entity_rect(others, object);
+    rect = try_move_axis(rect, velocity->y, AXIS_Y, others, broadphase, &collision);
+    rect = try_move_axis(rect, velocity->x, AXIS_X, others, broadphase, &collision);
+    set_entity_rect(others, object, rect);
     if (collision.sides_touched & (DIR_UP | DIR_DOWN)) {
-        object->velocity.y = 0;
-        if (object->velocity.x) {
+        velocity->y = 0;
+        if (velocity->x) {
             #define STOP_VELOCITY .01f
-            if (fabs(object->velocity.x) < STOP_VELOCITY) {
-                object->velocity.x = 0;
+            if (fabs(velocity->x) < STOP_VELOCITY) {
+                velocity->x = 0;
             } else {
-                f32 vel = object->velocity.x;
-                object->velocity.x -= SIGN(vel) * ((fabs(vel) + .3f) / 200);
+                f32 vel = velocity->x;
+                velocity->x -= SIGN(vel) * ((fabs(vel) + .3f) / 200);
             }
         }
     }
     if (collision.sides_touched & (DIR_DOWN)) {
-        object->grounded = true;
-        object->standing_on = others + collision.other_index;
-        if (object->facing = DIR_DOWN) {
-            object->facing = DIR_LEFT;
+        others->grounded[object] = true;
+        others->standing_on[object] = collision.other_index >= 0 ? entity_handle(others, collision.other_index) : STANDING_ON_TILES;
+        if (others->cold[object].facing = DIR_DOWN) {
+            others->cold[object].facing = DIR_LEFT;
         }
     }
     if (collision.sides_touched & (DIR_RIGHT | DIR_LEFT)) {
-        object->velocity.x *= -1;
+        velocity->x *= -1;
+    }
+    entity_moved(broadphase, others, object);
+}
+
+// Tiles only go away through erase_obstacle, which sends whoever stood on them falling again.
+bool support_alive(Entity_Store* entities, Entity_Handle standing_on) {
+    return standing_on == STANDING_ON_TILES || entity_alive(entities, standing_on);
+}
+
+#define GROUND_PROBE_DEPTH .05f
+// side is 1 for the right end of the object and -1 for the left one.
+bool ground_below(Broadphase_State* broadphase, Entity_Store* entities, Entity_Handle standing_on, f32 x, f32 side, f32 bottom) {
+    // What the object landed on is right below its feet, so only probe past its ends.
+    if (entity_alive(entities, standing_on)) {
+        Rectf support = entity_rect(entities, handle_slot(standing_on));
+        if (x > support.posx - support.radiusx && x < support.posx + support.radiusx) return true;
     }
+    Tile_Map* map = &broadphase->tile_map;
+    if (map->active) {
+        // Just inside the end, so an end on the seam of two tiles finds the one it's still over.
+        s32 tilex = (s32)floorf((x - side * COLLISION_EPSILON - map->origin.x) / TILE_SIZE);
+        s32 tiley = (s32)floorf((bottom - GROUND_PROBE_DEPTH - map->origin.y) / TILE_SIZE);
+        if (tile_map_get(map, tilex, tiley) == TILE_SOLID) return true;
+    }
+    Raycast_Hit hit;
+    return raycast(broadphase, entities, Vec2f{ x, bottom }, Vec2f{ x, bottom - GROUND_PROBE_DEPTH }, ENTITY_STATIC, &hit);
 }
 
-void update_grounded(Entity* object) {
-    object->velocity.x = 0;
-    object->velocity.y = 0;
-    switch (object->type) {
+void update_grounded(u32 object, Entity_Store* others, Broadphase_State* broadphase) {
+    others->velocity[object] = Vec2f{};
+    switch (others->type[object]) {
         case ENTITY_MONSTER:
             {
-                Entity* other = object->standing_on;
-                bool outside_right = object->posx + object->radiusx > other->posx + other->radiusx;
-                bool outside_left  = object->posx - object->radiusx < other->posx - other->radiusx;
+                Vec2f pos    = others->rect[object].pos;
+                Vec2f radius = others->rect[object].radius;
+                Direction* facing = &others->cold[object].facing;
+                Entity_Handle standing_on = others->standing_on[object];
+                // Probing instead of comparing against standing_on lets monsters walk across statics and tiles that touch.
+                f32 bottom = pos.y - radius.y;
+                bool outside_right = !ground_below(broadphase, others, standing_on, pos.x + radius.x,  1, bottom);
+                bool outside_left  = !ground_below(broadphase, others, standing_on, pos.x - radius.x, -1, bottom);
                 if (outside_right && outside_left) {
-                    object->facing = DIR_DOWN;
+                    *facing = DIR_DOWN;
                 } else if (outside_right) {
-                    object->facing = DIR_LEFT;
+                    *facing = DIR_LEFT;
                 } else if (outside_left) {
-                    object->facing = DIR_RIGHT;
-                } else if (object->facing == DIR_DOWN) {
-                    object->facing = DIR_RIGHT;
+                    *facing = DIR_RIGHT;
+                } else if (*facing == DIR_DOWN) {
+                    *facing = DIR_RIGHT;
                 }
-                object->posx += object->move_speed * direction_to_int(object->facing);
+                Rectf rect = entity_rect(others, object);
+                rect.posx += others->cold[object].move_speed * direction_to_int(*facing);
+                set_entity_rect(others, object, rect);
+                entity_moved(broadphase, others, object);
             }
             break;
         case ENTITY_PROJECTILE:
@@ -291,151 +1794,653 @@ u32 overlap_mapping[COLLIDABLE_ENTITIES_COUNT] = {
     ENTITY_NONE, // None
     ENTITY_DOOR, // Player
     0,           // Static
-    ENTITY_PROJECTILE | ENTITY_PLAYER_ATTACK | ENTITY_SPIKE, // Monster
+    ENTITY_PROJECTILE, // Monster, spikes come from the static layer
     0, // Projectile
     0, // Player attack
     0, // Spike
     0, // Door 
 };
 
-void push_to_list(Overlap_Info_List* list, Overlap_Info_Node node, Arena* perm) {
-    Overlap_Info_Node* new_node = (Overlap_Info_Node*)arena_append(perm, sizeof(Overlap_Info_Node));
-    *new_node = node;
-    if (!list->first || !list->last) {
-        assert(!list->first && !list->last);
-        list->first = list->last = new_node;
-    } else {
-        list->last->next = new_node;
-        list->last = new_node;
+bool overlap_cares(Entity_Type a, Entity_Type b) {
+    return (overlap_mapping[flag_to_int(a)] & b) || (overlap_mapping[flag_to_int(b)] & a);
+}
+
+// Types that show up on either side of overlap_mapping, everything else never needs to enter a broadphase.
+Entity_Type_Flag overlap_relevant_types() {
+    Entity_Type_Flag result = 0;
+    for (u32 i = 0; i < COLLIDABLE_ENTITIES_COUNT; ++i) {
+        if (overlap_mapping[i]) result |= overlap_mapping[i] | (i ? 1 << (i - 1) : 0);
+    }
+    return result;
+}
+
+// Types that care about some other type, every pair worth testing has one of these on at least one side.
+Entity_Type_Flag overlap_carer_types() {
+    Entity_Type_Flag result = 0;
+    for (u32 i = 1; i < COLLIDABLE_ENTITIES_COUNT; ++i) {
+        if (overlap_mapping[i]) result |= 1 << (i - 1);
     }
+    return result;
 }
 
-void overlap_entities(Entity* entities, u32 entities_count, Overlap_Info_List* overlap_lists, Arena* perm) {
-    u32 result_count = 0;
-    for (int i = 0; i < entities_count - 1; ++i) {
+u32 entities_of_types(Entity_Store* entities, Entity_Type_Flag types) {
+    u32 result = 0;
+    for (u32 i = 0; i < ENTITY_TYPE_COUNT; ++i) {
+        if (types & (1 << i)) result += entities->tables[i].count;
+    }
+    return result;
+}
+
+// The types the broadphases search from. When the carers are outnumbered, say a monster in a crowd of projectiles,
+// searching from them alone keeps the crowd from being tested against itself.
+Entity_Type_Flag overlap_searchers(Entity_Store* entities, bool* from_carers) {
+    Entity_Type_Flag relevant = overlap_relevant_types();
+    Entity_Type_Flag carers = overlap_carer_types();
+    u32 carers_count = entities_of_types(entities, carers);
+    *from_carers = carers_count < entities_of_types(entities, relevant) - carers_count;
+    return *from_carers ? carers : relevant;
+}
+
+// Appends an event for each side that cares about the other, returns how many.
+u32 overlap_pair(Entity_Store* entities, u32 i, u32 j, Arena* scratch) {
+    Entity_Type type_a = entities->type[i];
+    Entity_Type type_b = entities->type[j];
+    bool a_cares_b = overlap_mapping[flag_to_int(type_a)] & type_b;
+    bool b_cares_a = overlap_mapping[flag_to_int(type_b)] & type_a;
+    if (!a_cares_b && !b_cares_a) {
+        return 0;
+    }
+    Rectf overlap;
+    bool collided = rectf_overlap(entity_rect(entities, i), entity_rect(entities, j), &overlap);
+    if (!collided) return 0;
+    u32 result = 0;
+    if (a_cares_b) {
+        Overlap_Event* event = push_struct_no_zero(scratch, Overlap_Event);
+        *event = Overlap_Event{ OVERLAP_BEGIN, i, Overlap_Info{ type_b, (s32)j, overlap } };
+        ++result;
+    }
+    if (b_cares_a) {
+        Overlap_Event* event = push_struct_no_zero(scratch, Overlap_Event);
+        *event = Overlap_Event{ OVERLAP_BEGIN, j, Overlap_Info{ type_a, (s32)i, overlap } };
+        ++result;
+    }
+    return result;
+}
+
+u32 broadphase_brute_force(Entity_Store* entities, Arena* scratch, Entity_Pair** pairs, Broadphase_Stats* stats) {
+    u32 entities_count = entities->count;
+    u32 pairs_count = 0;
+    *pairs = push_array_no_zero(scratch, Entity_Pair, 0);
+    for (int i = 0; i < (s32)entities_count - 1; ++i) {
         for (int j = i + 1; j < entities_count; ++j) {
-            Entity* a = entities + i;
-            Entity* b = entities + j;
-            bool a_cares_b = overlap_mapping[flag_to_int(a->type)] & b->type;
-            bool b_cares_a = overlap_mapping[flag_to_int(b->type)] & a->type;
-            if (!a_cares_b && !b_cares_a) {
-                continue;
+            ++stats->pairs_tested;
+            if (entities->asleep[i] && entities->asleep[j]) continue;
+            if (!overlap_cares(entities->type[i], entities->type[j])) continue;
+            Entity_Pair* pair = push_struct_no_zero(scratch, Entity_Pair);
+            *pair = Entity_Pair{ (u32)i, (u32)j };
+            ++pairs_count;
+        }
+    }
+    stats->candidates += pairs_count;
+    return pairs_count;
+}
+
+//
+// Uniform grid broadphase
+// Entities are bucketed by every cell their rect touches, cells are hashed into a fixed number of buckets.
+// A pair sharing several cells is only reported from the cell holding the corner where their rects start overlapping.
+#define GRID_CELL_SIZE 2.f
+#define GRID_BUCKETS_COUNT 4096
+struct Grid_Entry {
+    u32 index;
+    s32 cellx;
+    s32 celly;
+};
+
+struct Grid_Range {
+    s32 minx;
+    s32 miny;
+    s32 maxx;
+    s32 maxy;
+};
+
+// Same as flooring, floorf is a library call without SSE4.1 and this runs for every corner of every rect.
+s32 grid_cell(f32 v) {
+    f32 cell = v / GRID_CELL_SIZE;
+    s32 truncated = (s32)cell;
+    return truncated - (cell < (f32)truncated);
+}
+
+Grid_Range grid_range(Rectf rect) {
+    return Grid_Range{ grid_cell(rect.posx - rect.radiusx), grid_cell(rect.posy - rect.radiusy),
+                       grid_cell(rect.posx + rect.radiusx), grid_cell(rect.posy + rect.radiusy) };
+}
+
+u32 grid_bucket(s32 cellx, s32 celly) {
+    u32 hash = (u32)cellx * 73856093u ^ (u32)celly * 19349663u;
+    return hash & (GRID_BUCKETS_COUNT - 1);
+}
+
+// Whether a and b are reported from a's cell, they have to share it and it has to hold the corner where their
+// rects start overlapping. Flooring keeps order, so that corner's cell is the larger of their first cells.
+bool grid_pair_reported(Entity_Store* entities, Grid_Entry* a, Grid_Range* ra, Grid_Entry* b, Grid_Range* rb) {
+    if (b->cellx != a->cellx || b->celly != a->celly) return false;
+    if (MAX(ra->minx, rb->minx) != a->cellx || MAX(ra->miny, rb->miny) != a->celly) return false;
+    if (entities->asleep[a->index] && entities->asleep[b->index]) return false;
+    return overlap_cares(entities->type[a->index], entities->type[b->index]);
+}
+
+// Pairs are appended to the arena one by one after the grid itself, so they end up contiguous at *pairs.
+// Only the searchers are bucketed. Searching from the carers, the rest are looked up in the buckets one by one,
+// so a crowd of projectiles is walked once instead of filling the buckets the monsters search. Both come from
+// the type tables, the static layer's slots are never walked.
+u32 broadphase_grid(Entity_Store* entities, Arena* scratch, Entity_Pair** pairs, Broadphase_Stats* stats) {
+    u32 entities_count = entities->count;
+    Entity_Type_Flag relevant = overlap_relevant_types();
+    bool from_carers;
+    Entity_Type_Flag searchers = overlap_searchers(entities, &from_carers);
+    u32* searcher_slots;
+    u32 searchers_count = gather_slots(entities, searchers, scratch, &searcher_slots);
+    u32* bucket_start = push_array(scratch, u32, GRID_BUCKETS_COUNT + 1);
+    Grid_Range* ranges = push_array_no_zero(scratch, Grid_Range, entities_count);
+    u32 entries_count = 0;
+    for (u32 k = 0; k < searchers_count; ++k) {
+        u32 i = searcher_slots[k];
+        Grid_Range range = grid_range(entity_rect(entities, i));
+        ranges[i] = range;
+        for (s32 y = range.miny; y <= range.maxy; ++y) {
+            for (s32 x = range.minx; x <= range.maxx; ++x) {
+                ++bucket_start[grid_bucket(x, y) + 1];
+                ++entries_count;
+            }
+        }
+    }
+    for (u32 i = 0; i < GRID_BUCKETS_COUNT; ++i) {
+        bucket_start[i + 1] += bucket_start[i];
+    }
+    u32* bucket_fill = push_array_no_zero(scratch, u32, GRID_BUCKETS_COUNT);
+    memcpy(bucket_fill, bucket_start, sizeof(u32) * GRID_BUCKETS_COUNT);
+    Grid_Entry* entries = push_array_no_zero(scratch, Grid_Entry, entries_count);
+    for (u32 k = 0; k < searchers_count; ++k) {
+        u32 i = searcher_slots[k];
+        Grid_Range range = ranges[i];
+        for (s32 y = range.miny; y <= range.maxy; ++y) {
+            for (s32 x = range.minx; x <= range.maxx; ++x) {
+                u32 bucket = grid_bucket(x, y);
+                entries[bucket_fill[bucket]++] = Grid_Entry{ i, x, y };
             }
-            Rectf overlap;
-            bool collided = rectf_overlap(a->rect, b->rect, &overlap);
-            if (!collided) continue;
-            if (a_cares_b) {
-                Overlap_Info_Node node;
-                node.data = { b->type, j, overlap };
-                push_to_list(overlap_lists + i, node, perm);
+        }
+    }
+
+    // Searching from the carers, the rest of the relevant types are looked up in the buckets.
+    u32* other_slots;
+    u32 others_count = from_carers ? gather_slots(entities, relevant & ~searchers, scratch, &other_slots) : 0;
+
+    // A pair of two searchers is kept from the earlier entry.
+    u32 pairs_count = 0;
+    *pairs = push_array_no_zero(scratch, Entity_Pair, 0);
+    for (u32 bucket = 0; bucket < GRID_BUCKETS_COUNT; ++bucket) {
+        for (u32 e = bucket_start[bucket]; e < bucket_start[bucket + 1]; ++e) {
+            Grid_Entry* a = entries + e;
+            for (u32 f = e + 1; f < bucket_start[bucket + 1]; ++f) {
+                Grid_Entry* b = entries + f;
+                ++stats->pairs_tested;
+                if (!grid_pair_reported(entities, a, ranges + a->index, b, ranges + b->index)) continue;
+                Entity_Pair* pair = push_struct_no_zero(scratch, Entity_Pair);
+                *pair = a->index < b->index ? Entity_Pair{ a->index, b->index } : Entity_Pair{ b->index, a->index };
+                ++pairs_count;
             }
-            if (b_cares_a) {
-                Overlap_Info_Node node;
-                node.data = { a->type, i, overlap };
-                push_to_list(overlap_lists + j, node, perm);
+        }
+    }
+    for (u32 k = 0; k < others_count; ++k) {
+        u32 i = other_slots[k];
+        Grid_Range range = grid_range(entity_rect(entities, i));
+        for (s32 y = range.miny; y <= range.maxy; ++y) {
+            for (s32 x = range.minx; x <= range.maxx; ++x) {
+                Grid_Entry b = { i, x, y };
+                u32 bucket = grid_bucket(x, y);
+                for (u32 e = bucket_start[bucket]; e < bucket_start[bucket + 1]; ++e) {
+                    Grid_Entry* a = entries + e;
+                    ++stats->pairs_tested;
+                    if (!grid_pair_reported(entities, a, ranges + a->index, &b, &range)) continue;
+                    Entity_Pair* pair = push_struct_no_zero(scratch, Entity_Pair);
+                    *pair = a->index < i ? Entity_Pair{ a->index, i } : Entity_Pair{ i, a->index };
+                    ++pairs_count;
+                }
             }
         }
     }
+    stats->candidates += pairs_count;
+    return pairs_count;
 }
 
-void launch(Entity* entity, Vec2f velocity) {
-    entity->grounded = false;
-    entity->standing_on = NULL;
-    entity->velocity = velocity;
+// Expects sweep_and_prune_update to have run this frame.
+u32 broadphase_sweep_and_prune(Entity_Store* entities, Sweep_And_Prune* sweep, Arena* scratch, Entity_Pair** pairs, Broadphase_Stats* stats) {
+    Entity_Type_Flag relevant = overlap_relevant_types();
+    u32 pairs_count = 0;
+    *pairs = push_array_no_zero(scratch, Entity_Pair, 0);
+    for (u32 i = 0; i < sweep->count; ++i) {
+        u32 index_a = sweep->order[i];
+        Entity_Type type_a = entities->type[index_a];
+        if (!(type_a & relevant)) continue;
+        f32 maxx = entities->rect[index_a].posx + entities->rect[index_a].radiusx;
+        for (u32 j = i + 1; j < sweep->count && sweep->minx[j] < maxx; ++j) {
+            ++stats->pairs_tested;
+            u32 index_b = sweep->order[j];
+            if (entities->asleep[index_a] && entities->asleep[index_b]) continue;
+            if (!overlap_cares(type_a, entities->type[index_b])) continue;
+            Entity_Pair* pair = push_struct_no_zero(scratch, Entity_Pair);
+            *pair = index_a < index_b ? Entity_Pair{ index_a, index_b } : Entity_Pair{ index_b, index_a };
+            ++pairs_count;
+        }
+    }
+    stats->candidates += pairs_count;
+    return pairs_count;
 }
 
-void delete_entity(Entity* entity) {
-    entity->type = ENTITY_NONE;
-}
+// Queries the tree with the rect of each searcher. Searching from the carers they query asleep or not, since what
+// they care about may be moving, otherwise only the awake ones query. A pair of two queriers is kept from the lower slot.
+// All queries run first, each pushing its slot and hit count ahead of its hits, then the pairs are made from the hits.
+u32 broadphase_dynamic_tree(Entity_Store* entities, Dynamic_Tree* tree, Arena* scratch, Entity_Pair** pairs, Broadphase_Stats* stats) {
+    bool from_carers;
+    Entity_Type_Flag searchers = overlap_searchers(entities, &from_carers);
+    u32* searcher_slots;
+    u32 searchers_count = gather_slots(entities, searchers, scratch, &searcher_slots);
+    u32* hits = push_array_no_zero(scratch, u32, 0);
+    for (u32 k = 0; k < searchers_count; ++k) {
+        u32 i = searcher_slots[k];
+        if (!from_carers && entities->asleep[i]) continue;
+        u32* query = push_array_no_zero(scratch, u32, 2);
+        query[0] = i;
+        query[1] = dynamic_tree_query(tree, entity_rect(entities, i), scratch, stats);
+    }
+    u32* hits_end = push_array_no_zero(scratch, u32, 0);
 
-void player_door_overlap(Player* player, Entity* door) {
-    if (door->flags & DOOR_OPEN) {
-        player->transition_level_in_direction = door->facing;
+    u32 pairs_count = 0;
+    *pairs = push_array_no_zero(scratch, Entity_Pair, 0);
+    while (hits < hits_end) {
+        u32 i = *hits++;
+        u32 results_count = *hits++;
+        Entity_Type type_a = entities->type[i];
+        for (u32 r = 0; r < results_count; ++r) {
+            u32 j = hits[r];
+            bool j_queried = (entities->type[j] & searchers) && (from_carers || !entities->asleep[j]);
+            if (j == i || (j < i && j_queried)) continue;
+            if (entities->asleep[i] && entities->asleep[j]) continue;
+            if (!overlap_cares(type_a, entities->type[j])) continue;
+            Entity_Pair* pair = push_struct_no_zero(scratch, Entity_Pair);
+            *pair = i < j ? Entity_Pair{ i, j } : Entity_Pair{ j, i };
+            ++pairs_count;
+        }
+        hits += results_count;
     }
+    stats->candidates += pairs_count;
+    return pairs_count;
 }
 
+bool rectf_equal(Rectf a, Rectf b) {
+    return a.posx == b.posx && a.posy == b.posy && a.radiusx == b.radiusx && a.radiusy == b.radiusy;
+}
 
+u64 overlap_key(Overlap_Event* event) {
+    return (u64)event->entity << HANDLE_SLOT_BITS | (u32)event->info.other_index;
+}
 
-const f32 CULL_OBJECT_IF_SMALLER = .2;
-u32 update_objects(Entity* objects, u32 objects_count, Arena scratch, u16* empty_entities_result, u16* empty_entities_result_count, Player* player) {
-    Overlap_Info_List* overlaps = (Overlap_Info_List*)arena_append(&scratch, sizeof(Overlap_Info_List) * objects_count);
-    overlap_entities(objects, objects_count, overlaps, &scratch);
-
-    u32 monsters_alive = 0;
-    for (int i = 0; i < objects_count; ++i) {
-        Entity* object = objects + i;
-        if (object->radiusx < CULL_OBJECT_IF_SMALLER || object->radiusy < CULL_OBJECT_IF_SMALLER) {
-            object->type = ENTITY_NONE;
-        }
-        Overlap_Info_Node* overlap = overlaps[i].first;
-        switch (object->type) {
-            case ENTITY_PLAYER:
-                while (overlap) {
-                    switch (overlap->data.type) {
-                        case ENTITY_DOOR:
-                            player_door_overlap(player, objects + overlap->data.other_index);
-                            break;
-                    }
-                    overlap = overlap->next;
-                }        
-                break;
-            case ENTITY_PLAYER_ATTACK:
-                break;
-            case ENTITY_MONSTER:
-                ++monsters_alive;
-                while (overlap) {
-                    switch (overlap->data.type) {
-                        case ENTITY_PLAYER_ATTACK:
-                            launch(object, { .1f * direction_to_int(objects[overlap->data.other_index].facing), .8f });
-                            break;
-                        case ENTITY_SPIKE:
-                            delete_entity(object);
-                            break;
-                    }
-                    overlap = overlap->next;
-                }
-            case ENTITY_PROJECTILE:
-                {
-                    #define COUNT_AS_LAUNCHED_VELOCITY .2f
-                    if (object->standing_on && object->standing_on->type &&
-                        fabs(object->velocity.x) < COUNT_AS_LAUNCHED_VELOCITY)
-                    {
-                        update_grounded(object);
-                    } else {
-                        update_launched(object, objects, objects_count);
-                    }
-                }
-                break;
-            case ENTITY_STATIC:
+// LSD radix sort by overlap_key, temp needs room for count events, the result ends up back in overlaps.
+// The counts for every digit come from one read, and a digit all keys share is skipped, with a few hundred
+// monsters the high bits of the entity always are.
+#define SORT_OVERLAPS_RADIX_BITS (HANDLE_SLOT_BITS / 2)
+#define SORT_OVERLAPS_PASSES (2 * HANDLE_SLOT_BITS / SORT_OVERLAPS_RADIX_BITS)
+void sort_overlaps(Overlap_Event* overlaps, Overlap_Event* temp, u32 count) {
+    const u32 radix_mask = (1u << SORT_OVERLAPS_RADIX_BITS) - 1;
+    u32 offsets[SORT_OVERLAPS_PASSES][(1 << SORT_OVERLAPS_RADIX_BITS) + 1] = {};
+    for (u32 i = 0; i < count; ++i) {
+        u64 key = overlap_key(overlaps + i);
+        for (u32 pass = 0; pass < SORT_OVERLAPS_PASSES; ++pass) {
+            ++offsets[pass][((key >> (pass * SORT_OVERLAPS_RADIX_BITS)) & radix_mask) + 1];
+        }
+    }
+    Overlap_Event* from = overlaps;
+    Overlap_Event* to   = temp;
+    for (u32 pass = 0; pass < SORT_OVERLAPS_PASSES; ++pass) {
+        u32 shift = pass * SORT_OVERLAPS_RADIX_BITS;
+        u32* pass_offsets = offsets[pass];
+        if (count && pass_offsets[((overlap_key(from) >> shift) & radix_mask) + 1] == count) continue;
+        for (u32 i = 0; i < radix_mask + 1; ++i) {
+            pass_offsets[i + 1] += pass_offsets[i];
+        }
+        for (u32 i = 0; i < count; ++i) {
+            to[pass_offsets[(overlap_key(from + i) >> shift) & radix_mask]++] = from[i];
+        }
+        Overlap_Event* swap = from;
+        from = to;
+        to = swap;
+    }
+    if (from != overlaps) memcpy(overlaps, from, sizeof(Overlap_Event) * count);
+}
+
+// Only candidate pairs where a side moved or changed type since the last frame go through the narrowphase,
+// the rest keep their overlap from the pair cache. Events are sorted by entity and contiguous at *events.
+// The cache is read from last frame's arena and written to this frame's, scratch must be neither.
+u32 overlap_entities(Entity_Store* entities, Broadphase_State* broadphase, Arena* scratch, Frame_Arenas* frames, Overlap_Event** events) {
+    u32 entities_count = entities->count;
+    Pair_Cache* cache = &broadphase->pair_cache;
+#if CPROJ_SLOW
+    assert(!cache->overlaps_count || frame_data_alive(frames, cache->overlaps_frame));
+#endif
+    Broadphase_Stats* stats = &broadphase->stats;
+    u32 slots_count = MAX(entities_count, cache->entities_count);
+    bool* dirty = push_array(scratch, bool, slots_count);
+    u32 dirty_count = 0;
+    // Only the overlap types are compared, the static layer's slots are never walked. A slot of another type is
+    // never in a pair, deleting one resets its snapshot in delete_entity.
+    Entity_Type_Flag relevant = overlap_relevant_types();
+    u32* slots;
+    u32 relevant_count = gather_slots(entities, relevant, scratch, &slots);
+    for (u32 k = 0; k < relevant_count; ++k) {
+        u32 i = slots[k];
+        Entity_Type type = entities->type[i];
+        // Both rects sit on 16 byte boundaries in their chunks.
+        __m128 rect   = _mm_load_ps(&entities->rect[i].posx);
+        __m128 cached = _mm_load_ps(&cache->rects[i].posx);
+        dirty[i] = type != cache->types[i] || _mm_movemask_ps(_mm_cmpeq_ps(rect, cached)) != 0xF;
+        cache->types[i] = type;
+        _mm_store_ps(&cache->rects[i].posx, rect);
+        dirty_count += dirty[i];
+    }
+    // A cached overlap whose side isn't of an overlap type anymore was deleted or replaced, it has ended.
+    for (u32 i = 0; i < cache->overlaps_count; ++i) {
+        u32 sides[2] = { cache->overlaps[i].entity, (u32)cache->overlaps[i].info.other_index };
+        for (u32 side = 0; side < 2; ++side) {
+            u32 slot = sides[side];
+            if (dirty[slot] || (slot < entities_count && (entities->type[slot] & relevant))) continue;
+            dirty[slot] = true;
+            ++dirty_count;
+        }
+    }
+    // Slots past the store's count read as empty, as the ones compaction vacates do.
+    for (u32 i = entities_count; i < cache->entities_count; ++i) {
+        cache->types[i] = ENTITY_NONE;
+        cache->rects[i] = {};
+    }
+    cache->entities_count = entities_count;
+    stats->dirty_entities += dirty_count;
+
+    Overlap_Event* fresh = NULL;
+    u32 fresh_count = 0;
+    if (dirty_count) {
+        Entity_Pair* pairs;
+        u32 pairs_count;
+        switch (broadphase->kind) {
+            case BROADPHASE_BRUTE_FORCE:
+                pairs_count = broadphase_brute_force(entities, scratch, &pairs, stats);
                 break;
-            case ENTITY_SPIKE:
+            case BROADPHASE_GRID:
+                pairs_count = broadphase_grid(entities, scratch, &pairs, stats);
                 break;
-            case ENTITY_DOOR:
+            case BROADPHASE_SWEEP_AND_PRUNE:
+                pairs_count = broadphase_sweep_and_prune(entities, &broadphase->sweep, scratch, &pairs, stats);
                 break;
-            case ENTITY_NONE:
-                empty_entities_result[(*empty_entities_result_count)++] = i;
+            case BROADPHASE_DYNAMIC_TREE:
+                pairs_count = broadphase_dynamic_tree(entities, &broadphase->dynamic_tree, scratch, &pairs, stats);
                 break;
             default:
                 assert(false);
-                break;
+                return 0;
+        }
+        fresh = push_array_no_zero(scratch, Overlap_Event, 0);
+        for (u32 i = 0; i < pairs_count; ++i) {
+            if (!dirty[pairs[i].a] && !dirty[pairs[i].b]) {
+                ++stats->cached_pairs;
+                continue;
+            }
+            fresh_count += overlap_pair(entities, pairs[i].a, pairs[i].b, scratch);
+        }
+        Overlap_Event* temp = push_array_no_zero(scratch, Overlap_Event, fresh_count);
+        sort_overlaps(fresh, temp, fresh_count);
+    }
+
+    // Merge the cached overlaps with the fresh ones. A cached overlap with a dirty side that the narrowphase
+    // didn't find again has ended.
+    *events = push_array_no_zero(scratch, Overlap_Event, 0);
+    u32 events_count = 0;
+    u32 cached_index = 0;
+    u32 fresh_index = 0;
+    u32 overlaps_count = 0;
+    while (cached_index < cache->overlaps_count || fresh_index < fresh_count) {
+        u64 cached_key = cached_index < cache->overlaps_count ? overlap_key(cache->overlaps + cached_index) : UINT64_MAX;
+        u64 fresh_key  = fresh_index  < fresh_count           ? overlap_key(fresh + fresh_index)            : UINT64_MAX;
+        Overlap_Event* event = push_struct_no_zero(scratch, Overlap_Event);
+        if (cached_key < fresh_key) {
+            *event = cache->overlaps[cached_index++];
+            bool retested = dirty[event->entity] || dirty[event->info.other_index];
+            event->kind = retested ? OVERLAP_END : OVERLAP_STAY;
+#if CPROJ_SLOW
+            if (!retested) {
+                Rectf overlap;
+                assert(rectf_overlap(entity_rect(entities, event->entity), entity_rect(entities, event->info.other_index), &overlap));
+            }
+#endif
+        } else if (fresh_key < cached_key) {
+            *event = fresh[fresh_index++];
+            event->kind = OVERLAP_BEGIN;
+        } else {
+            *event = fresh[fresh_index++];
+            ++cached_index;
+            event->kind = OVERLAP_STAY;
         }
+        ++events_count;
+        if (event->kind != OVERLAP_END) ++overlaps_count;
+    }
+
+    cache->overlaps = push_array_no_zero(frame_arena_current(frames), Overlap_Event, overlaps_count);
+    cache->overlaps_count = 0;
+    cache->overlaps_frame = frames->frame;
+    for (u32 i = 0; i < events_count; ++i) {
+        if ((*events)[i].kind == OVERLAP_END) continue;
+        cache->overlaps[cache->overlaps_count++] = (*events)[i];
+    }
+    return events_count;
+}
+
+Entity_Handle remap_handle(Entity_Store* entities, u32* moved_to, Entity_Handle handle) {
+    if (!entity_alive(entities, handle) || !moved_to[handle_slot(handle)]) return handle;
+    return entity_handle(entities, moved_to[handle_slot(handle)] - 1);
+}
+
+// Moves live entities from the top of the store down into the free slots, so loops over the store cost what
+// the live entities do instead of the high-water mark. Handles to moved entities are remapped.
+void compact_entities(Game_Info* game_info) {
+    Entity_Store* entities = &game_info->entities;
+    Broadphase_State* broadphase = &game_info->broadphase;
+    Pair_Cache* cache = &broadphase->pair_cache;
+    Temp_Memory scratch = get_scratch(game_info->scratch_pool, NULL);
+    u32* moved_to = push_array(scratch.arena, u32, entities->count); // new slot + 1, 0 for staying put
+    // Slots of deferred creates look free.
+    assert(!game_info->commands.creates_count && !game_info->commands.deletes_count);
+
+    // A cached overlap with a freed slot would carry over to whatever moves into it.
+    u32 kept = 0;
+    for (u32 i = 0; i < cache->overlaps_count; ++i) {
+        Overlap_Event event = cache->overlaps[i];
+        if (!entities->type[event.entity] || !entities->type[event.info.other_index]) continue;
+        cache->overlaps[kept++] = event;
+    }
+    cache->overlaps_count = kept;
+
+    bool statics_moved = false;
+    u32 low = 0;
+    u32 high = entities->count;
+    while (true) {
+        while (low < high && entities->type[low]) ++low;
+        while (high > low && !entities->type[high - 1]) --high;
+        if (low >= high) break;
+        u32 from = --high;
+        statics_moved |= (entities->type[from] & STATIC_LAYER_TYPES) != 0;
+        // To consumers the entity is deleted and created again, the slot is what they know it by.
+        journal_record(entities, from, JOURNAL_DELETED);
+        journal_record(entities, low, JOURNAL_CREATED);
+        set_entity(entities, low, get_entity(entities, from));
+        entities->table_index[low] = entities->table_index[from];
+        entity_table(entities, entities->type[low])->slots[entities->table_index[low]] = low;
+        entities->type[from] = ENTITY_NONE;
+        dynamic_tree_relabel(&broadphase->dynamic_tree, from, low);
+        sparse_set_relabel(&entities->doors.set, from, low, game_info->persistent_arena);
+        // The snapshot moves along so the entity doesn't count as dirty, unless it was created after the snapshot.
+        cache->types[low] = from < cache->entities_count ? cache->types[from] : ENTITY_NONE;
+        cache->rects[low] = cache->rects[from];
+        moved_to[from] = low + 1;
+        ++low;
     }
 
-    for (int i = 0; i < objects_count; ++i) {
-        Entity* object = objects + i;
+    // Old handles still validate here, generations of the vacated slots only move on below.
+    for (u32 i = 0; i < low; ++i) {
+        entities->standing_on[i] = remap_handle(entities, moved_to, entities->standing_on[i]);
+    }
+    game_info->player.e      = remap_handle(entities, moved_to, game_info->player.e);
+    game_info->player.attack = remap_handle(entities, moved_to, game_info->player.attack);
+    for (u32 i = low; i < entities->count; ++i) {
+        if (moved_to[i]) next_generation(entities, i);
+    }
+    entities->count = low;
+    game_info->empty_entities_count = 0;
 
-        if (object->type == ENTITY_DOOR) {
-            if (monsters_alive == 0) object->flags |=  DOOR_OPEN;
-            else                     object->flags &= ~DOOR_OPEN;
+    for (u32 i = 0; i < cache->overlaps_count; ++i) {
+        Overlap_Event* event = cache->overlaps + i;
+        if (moved_to[event->entity])           event->entity           = moved_to[event->entity] - 1;
+        if (moved_to[event->info.other_index]) event->info.other_index = moved_to[event->info.other_index] - 1;
+    }
+    Overlap_Event* temp = push_array_no_zero(scratch.arena, Overlap_Event, cache->overlaps_count);
+    sort_overlaps(cache->overlaps, temp, cache->overlaps_count);
+    // The vacated slots have to read as empty, an entity created into one later is compared against its snapshot.
+    for (u32 i = low; i < cache->entities_count; ++i) {
+        cache->types[i] = ENTITY_NONE;
+        cache->rects[i] = {};
+    }
+    cache->entities_count = MIN(cache->entities_count, low);
+    end_temp_memory(scratch);
+
+    if (statics_moved) static_layer_build(&broadphase->statics, entities, game_info->persistent_arena);
+}
+
+void wake(Entity_Store* entities, u32 slot) {
+    entities->asleep[slot] = false;
+    entities->still_frames[slot] = 0;
+}
+
+void launch(Entity_Store* entities, u32 slot, Vec2f velocity) {
+    wake(entities, slot);
+    entities->grounded[slot] = false;
+    entities->standing_on[slot] = 0;
+    entities->velocity[slot] = velocity;
+}
+
+void player_door_overlap(Player* player, Entity_Store* entities, u32 door) {
+    if (COMPONENT_GET(entities->doors, door)->flags & DOOR_OPEN) {
+        player->transition_level_in_direction = entities->cold[door].facing;
+    }
+}
+
+
+
+// Monsters and projectiles that went this many updates without moving stop being updated until something wakes them.
+#define SLEEP_AFTER_FRAMES 30
+void update_movers(Game_Info* game_info, Entity_Table* movers) {
+    Entity_Store* objects = &game_info->entities;
+    Broadphase_State* broadphase = &game_info->broadphase;
+    for (u32 i = 0; i < movers->count; ++i) {
+        u32 slot = movers->slots[i];
+        if (objects->asleep[slot]) {
+            // Whatever a sleeper rests on can be deleted under it.
+            if (!objects->standing_on[slot] || support_alive(objects, objects->standing_on[slot])) {
+                ++game_info->sleeping_entities_count;
+                continue;
+            }
+            wake(objects, slot);
         }
+        ++game_info->active_entities_count;
+        Rectf rect = entity_rect(objects, slot);
+        Vec2f velocity = objects->velocity[slot];
+        #define COUNT_AS_LAUNCHED_VELOCITY .2f
+        if (support_alive(objects, objects->standing_on[slot]) &&
+            fabs(velocity.x) < COUNT_AS_LAUNCHED_VELOCITY)
+        {
+            update_grounded(slot, objects, broadphase);
+        } else {
+            update_launched(slot, objects, broadphase);
+        }
+        if (!rectf_equal(rect, entity_rect(objects, slot)) || velocity.x != objects->velocity[slot].x || velocity.y != objects->velocity[slot].y) {
+            objects->still_frames[slot] = 0;
+        } else if (++objects->still_frames[slot] >= SLEEP_AFTER_FRAMES) {
+            objects->asleep[slot] = true;
+        }
+    }
+}
 
-        if (!object->standing_on) continue;
-        if (!object->standing_on->type) {
-            object->standing_on = NULL;
-            continue;
+void update_objects(Game_Info* game_info) {
+    Temp_Memory scratch = get_scratch(game_info->scratch_pool, frame_arena_current(game_info->frame_arenas));
+    Entity_Store* objects = &game_info->entities;
+    Player* player = &game_info->player;
+    Broadphase_State* broadphase = &game_info->broadphase;
+    if (broadphase->kind == BROADPHASE_SWEEP_AND_PRUNE) {
+        sweep_and_prune_update(&broadphase->sweep, objects, ~STATIC_LAYER_TYPES);
+    }
+    // Statics only move in the editor, the layer marks the sweep stale then.
+    if (broadphase->static_query == STATIC_QUERY_SWEEP && broadphase->statics.solids_sweep_stale) {
+        sweep_and_prune_update(&broadphase->statics.solids_sweep, objects, ENTITY_STATIC);
+        broadphase->statics.solids_sweep_stale = false;
+    }
+    Overlap_Event* events;
+    u32 events_count = overlap_entities(objects, broadphase, scratch.arena, game_info->frame_arenas, &events);
+    // Sleepers don't move, so a new overlap means something active ran into them.
+    for (u32 i = 0; i < events_count; ++i) {
+        if (events[i].kind != OVERLAP_BEGIN) continue;
+        wake(objects, events[i].entity);
+        wake(objects, events[i].info.other_index);
+    }
+
+    // The attack entity is only drawn and timed, what it hits comes from a query.
+    if (entity_alive(objects, player->attack)) {
+        u32 attack = handle_slot(player->attack);
+        u32* hits;
+        u32 hits_count = query_rect(broadphase, objects, entity_rect(objects, attack), ENTITY_MONSTER, scratch.arena, &hits);
+        for (u32 i = 0; i < hits_count; ++i) {
+            launch(objects, hits[i], { .1f * direction_to_int(objects->cold[attack].facing), .8f });
         }
     }
-    return objects_count;
+
+    // Of the overlap events, only the player's with doors do anything.
+    for (u32 i = 0; i < events_count; ++i) {
+        Overlap_Event* event = events + i;
+        if (event->kind == OVERLAP_END) continue;
+        if (objects->type[event->entity] == ENTITY_PLAYER && event->info.type == ENTITY_DOOR) {
+            player_door_overlap(player, objects, event->info.other_index);
+        }
+    }
+
+    // Spikes are level geometry, monsters look them up in the static layer or the tile map.
+    // Killed monsters still move and keep the doors shut until the end of the frame.
+    Entity_Table* monsters = entity_table(objects, ENTITY_MONSTER);
+    for (u32 i = 0; i < monsters->count; ++i) {
+        u32 slot = monsters->slots[i];
+        Rectf rect = entity_rect(objects, slot);
+        if (static_tree_overlaps(&broadphase->statics.spikes, rect) ||
+            (broadphase->tile_map.active && tile_map_overlaps(&broadphase->tile_map, rect, TILE_SPIKE)))
+        {
+            defer_delete_entity(game_info, slot);
+        }
+    }
+
+    game_info->active_entities_count = 0;
+    game_info->sleeping_entities_count = 0;
+    update_movers(game_info, monsters);
+    update_movers(game_info, entity_table(objects, ENTITY_PROJECTILE));
+
+    for (u32 i = 0; i < objects->doors.set.count; ++i) {
+        if (monsters->count == 0) objects->doors.items[i].flags |=  DOOR_OPEN;
+        else                      objects->doors.items[i].flags &= ~DOOR_OPEN;
+    }
+    end_temp_memory(scratch);
 }
 
 Rectf points_to_rect(Vec2f a, Vec2f b) {
@@ -467,11 +2472,19 @@ void draw_obstacle(Drawing_Obstacle& drawing, Mouse* mouse, Camera camera, Game_
     } else {
         Rectf screen_rect = points_to_rect(drawing.pos, mouse->pos);
         Rectf scaled_rect = scale_rect(screen_rect, camera.scale);
-        Entity* obstacle = create_entity(frame);
-        *obstacle = Entity{ type, move_rect(scaled_rect, camera.pos)};
-        obstacle->facing = DIR_RIGHT;
-        obstacle->move_speed = .02f;
+        Entity obstacle = Entity{ type, move_rect(scaled_rect, camera.pos)};
+        obstacle.facing = DIR_RIGHT;
+        obstacle.move_speed = .02f;
         drawing.active = false;
+        Tile_Map* map = &frame->broadphase.tile_map;
+        if (map->active && (type == ENTITY_STATIC || type == ENTITY_SPIKE) && tile_map_fits(map, obstacle.rect)) {
+            tile_map_fill(map, obstacle.rect, type == ENTITY_STATIC ? TILE_SOLID : TILE_SPIKE);
+            return;
+        }
+        Entity_Handle handle = create_entity(frame, obstacle);
+        if (handle && (type & STATIC_LAYER_TYPES)) {
+            static_layer_add(&frame->broadphase.statics, &frame->entities, handle_slot(handle), frame->persistent_arena);
+        }
     }
 }
 
@@ -483,11 +2496,43 @@ Rectf screen_to_world(Rectf r, Camera camera) {
     return Rectf { screen_to_world(r.pos, camera), r.radiusx * camera.scale, r.radiusy * camera.scale };
 }
 
-void erase_obstacle(Mouse* mouse, Entity* obstacles, u32 obstacles_count, Camera camera) {
+// Lowest slot of the given types under point, entities->count if there is none.
+u32 pick_entity(Broadphase_State* broadphase, Entity_Store* entities, Vec2f point, Entity_Type_Flag types, Arena* scratch) {
+    u32* hits;
+    u32 hits_count = query_point(broadphase, entities, point, types, scratch, &hits);
+    u32 result = entities->count;
+    for (u32 i = 0; i < hits_count; ++i) {
+        result = MIN(result, hits[i]);
+    }
+    return result;
+}
+
+void erase_obstacle(Mouse* mouse, Game_Info* game_info, Camera camera) {
     if (!mouse->right.presses) return;
-    u32 overlap_index = first_overlap_index(screen_to_world(Rectf {mouse->pos, 0, 0}, camera), obstacles, obstacles_count, 0XFFFFFFFF & ~ENTITY_PLAYER);
+    Entity_Store* obstacles = &game_info->entities;
+    u32 obstacles_count = obstacles->count;
+    Temp_Memory scratch = get_scratch(game_info->scratch_pool, NULL);
+    u32 overlap_index = pick_entity(&game_info->broadphase, obstacles, screen_to_world(mouse->pos, camera), 0XFFFFFFFF & ~ENTITY_PLAYER, scratch.arena);
+    end_temp_memory(scratch);
     if (overlap_index < obstacles_count) {
-        delete_entity(obstacles + overlap_index);
+        Entity_Type type = obstacles->type[overlap_index];
+        delete_entity(game_info, overlap_index);
+        if (type & STATIC_LAYER_TYPES) {
+            static_layer_remove(&game_info->broadphase.statics, obstacles, type, overlap_index, entity_rect(obstacles, overlap_index), game_info->persistent_arena);
+        }
+    } else if (game_info->broadphase.tile_map.active) {
+        Tile_Map* map = &game_info->broadphase.tile_map;
+        Vec2f world = screen_to_world(mouse->pos, camera);
+        s32 x = (s32)floorf((world.x - map->origin.x) / TILE_SIZE);
+        s32 y = (s32)floorf((world.y - map->origin.y) / TILE_SIZE);
+        if (tile_map_get(map, x, y) == TILE_EMPTY) return;
+        map->tiles[y * TILE_MAP_WIDTH + x] = TILE_EMPTY;
+        // Which tile an object stands on isn't kept, so everything wakes and whoever stood on tiles falls again,
+        // landing on whatever is left.
+        for (u32 i = 0; i < obstacles_count; ++i) {
+            wake(obstacles, i);
+            if (obstacles->standing_on[i] == STANDING_ON_TILES) obstacles->standing_on[i] = 0;
+        }
     }
 }
 
@@ -498,7 +2543,6 @@ Camera update_camera(Camera camera, Input* input) {
 
 void init_game_state(Game_Info* game_info) {
     f32 scale = .05f;
-    game_info->player.e = game_info->entities;
     game_info->camera.scale = scale * 2;
 
     game_info->display_text_count = 0;
@@ -507,6 +2551,9 @@ void init_game_state(Game_Info* game_info) {
     game_info->drawing.active = false;
     game_info->game_state_is_initialiezed = true;
     game_info->currently_drawing = ENTITY_STATIC;
+    game_info->broadphase.kind = BROADPHASE_GRID;
+    game_info->broadphase.static_query = STATIC_QUERY_TREE;
+    dynamic_tree_clear(&game_info->broadphase.dynamic_tree);
 }
 
 // Idea: Loop over entire text and get list of indices of new lines
@@ -522,7 +2569,16 @@ void init_game_state(Game_Info* game_info) {
 #define ENTITY_FACING " facing="
 #define LENGTH(s) (sizeof(s) - 1)
 void parse_savefile(char* text_start, u32 text_size, Game_Info* game_info) {
-    game_info->entities_count = 0;
+    // Handles into the old level, like the player's attack, must not find whatever lands in their slot.
+    for (u32 i = 0; i < game_info->entities.count; ++i) {
+        next_generation(&game_info->entities, i);
+    }
+    game_info->entities.count = 0;
+    game_info->entities.journal.overflowed = true;
+    for (u32 i = 0; i < ENTITY_TYPE_COUNT; ++i) {
+        game_info->entities.tables[i].count = 0;
+    }
+    sparse_set_clear(&game_info->entities.doors.set);
     game_info->empty_entities_count = 0;
     u32 count = 0;
     char* text = text_start;
@@ -537,8 +2593,8 @@ void parse_savefile(char* text_start, u32 text_size, Game_Info* game_info) {
             f32 radiusy = strtof(text + LENGTH(ENTITY_RADIUSY), &text);
             f32 move_speed = strtof(text + LENGTH(ENTITY_MOVE_SPEED), &text);
             Direction facing = (Direction)strtol(text + LENGTH(ENTITY_FACING), &text, 10);
-            Entity* result = create_entity(game_info);
-            *result = Entity{ type, Rectf{ posx, posy, radiusx, radiusy }, move_speed, facing};
+            Entity_Handle handle = create_entity(game_info, Entity{ type, Rectf{ posx, posy, radiusx, radiusy }, move_speed, facing});
+            if (type == ENTITY_PLAYER) game_info->player.e = handle;
         }
         while (true) {
             if (text - text_start + 1 >= text_size) return;
@@ -549,21 +2605,83 @@ void parse_savefile(char* text_start, u32 text_size, Game_Info* game_info) {
     }
 }
 
-void load_level(char* level_path, Game_Info* game_info, Arena scratch) {
-    u32 file_size = game_info->platform_read_entire_file(scratch, level_path);
-    char* file_content = (char*)arena_current(scratch);
+// Moves the level's statics and spikes into the tile map, which starts at their lower left corner. Ones that
+// don't fit it whole or don't sit on tile edges stay entities, the map couldn't give them back as they were.
+void tile_map_rasterize(Tile_Map* map, Game_Info* game_info) {
+    memset(map->tiles, 0, sizeof(map->tiles));
+    Entity_Store* entities = &game_info->entities;
+    bool any = false;
+    Vec2f min = {};
+    for (u32 i = 0; i < entities->count; ++i) {
+        if (entities->type[i] != ENTITY_STATIC && entities->type[i] != ENTITY_SPIKE) continue;
+        f32 minx = entities->rect[i].posx - entities->rect[i].radiusx;
+        f32 miny = entities->rect[i].posy - entities->rect[i].radiusy;
+        min.x = any ? MIN(min.x, minx) : minx;
+        min.y = any ? MIN(min.y, miny) : miny;
+        any = true;
+    }
+    map->origin = Vec2f{ floorf(min.x / TILE_SIZE) * TILE_SIZE, floorf(min.y / TILE_SIZE) * TILE_SIZE };
+    for (u32 i = 0; i < entities->count; ++i) {
+        if (entities->type[i] != ENTITY_STATIC && entities->type[i] != ENTITY_SPIKE) continue;
+        if (!tile_map_fits(map, entity_rect(entities, i))) continue;
+        tile_map_fill(map, entity_rect(entities, i), entities->type[i] == ENTITY_STATIC ? TILE_SOLID : TILE_SPIKE);
+        delete_entity(game_info, i);
+    }
+}
+
+// The file is only read into scratch, what loading takes from the persistent arena are entity chunks.
+void load_level(char* level_path, Game_Info* game_info) {
+    dynamic_tree_clear(&game_info->broadphase.dynamic_tree);
+    Temp_Memory scratch = get_scratch(game_info->scratch_pool, NULL);
+    char* file_content = (char*)arena_current(scratch.arena);
+    u32 file_size = game_info->platform_read_entire_file(scratch.arena, level_path);
     parse_savefile(file_content, file_size, game_info);
+    end_temp_memory(scratch);
+    game_info->broadphase.tile_map.active = game_info->broadphase.tile_map.enabled;
+    if (game_info->broadphase.tile_map.active) {
+        tile_map_rasterize(&game_info->broadphase.tile_map, game_info);
+    } else {
+        memset(game_info->broadphase.tile_map.tiles, 0, sizeof(game_info->broadphase.tile_map.tiles));
+    }
+    static_layer_build(&game_info->broadphase.statics, &game_info->entities, game_info->persistent_arena);
 
     game_info->player.transition_level_in_direction = DIR_NONE;
 }
 
+// Serialized into scratch, level geometry in the tile map goes out as plain statics and spikes
+// so the file still loads with the tile map off.
+void save_level(const char* level_path, Game_Info* game_info) {
+    Entity_Store* entities = &game_info->entities;
+    Temp_Memory scratch = get_scratch(game_info->scratch_pool, NULL);
+    char* text = (char*)arena_current(scratch.arena);
+    u32 total_length = 0;
+    for (u32 i = 0; i < entities->count; ++i) {
+        if (!entities->type[i]) continue;
+        total_length += serialize_entity(get_entity(entities, i), scratch.arena);
+    }
+    if (game_info->broadphase.tile_map.active) {
+        u32 cursor = 0;
+        Tile tile;
+        Rectf rect;
+        while (tile_map_next_run(&game_info->broadphase.tile_map, &cursor, &tile, &rect)) {
+            Entity object = Entity{ tile == TILE_SOLID ? ENTITY_STATIC : ENTITY_SPIKE, rect };
+            object.facing = DIR_RIGHT;
+            total_length += serialize_entity(object, scratch.arena);
+        }
+    }
+    game_info->platform_write_entire_file(level_path, text, total_length);
+    end_temp_memory(scratch);
+}
+
 #define ATTACK_DURATION 20
-void update_player(Player* player) {
+void update_player(Player* player, Game_Info* game_info) {
     if (player->attack) {
         u32 frames_active = player->attack_frames;
-        if (frames_active > ATTACK_DURATION) {
-            delete_entity(player->attack);
-            player->attack = NULL;
+        // Loading a level frees the attack along with everything else.
+        bool alive = entity_alive(&game_info->entities, player->attack);
+        if (!alive || frames_active > ATTACK_DURATION) {
+            if (alive) defer_delete_entity(game_info, handle_slot(player->attack));
+            player->attack = 0;
             player->attack_frames = 0;
         } else {
             player->attack_frames = ++frames_active;
@@ -573,12 +2691,14 @@ void update_player(Player* player) {
 
 bool update_game(Arena* frame_state, Arena* persistent_state) {
     Game_Info* game_info = (Game_Info*)persistent_state->data;
+    game_info->persistent_arena = persistent_state;
+    journal_begin(&game_info->entities.journal, frame_state);
     if (!game_info->game_state_is_initialiezed) {
         init_game_state(game_info);
         
-        load_level("test.txt", game_info, *persistent_state);
+        load_level("test.txt", game_info);
     }
-    game_info->empty_entities_count = 0;
+    game_info->broadphase.stats = {};
 
     Player* player = &game_info->player;
     *player = game_info->player;
@@ -592,21 +2712,35 @@ bool update_game(Arena* frame_state, Arena* persistent_state) {
     }
 
     if (player->transition_level_in_direction || game_info->input[INPUT_EDITOR_LOAD].presses) {
-        load_level("test.txt", game_info, *persistent_state);
+        load_level("test.txt", game_info);
         player->transition_level_in_direction = DIR_NONE;
     }
 
-    game_info->entities_count = update_objects(game_info->entities, game_info->entities_count, *frame_state, game_info->empty_entities, &game_info->empty_entities_count, player);
-    update_player(player);
+    // Compacting touches every slot and handle, so it waits until a good share of the slots are free.
+    #define COMPACT_MIN_FREE 64
+    if (game_info->empty_entities_count >= COMPACT_MIN_FREE && game_info->empty_entities_count * 4 >= game_info->entities.count) {
+        compact_entities(game_info);
+    }
+    if (game_info->spawn_projectiles) {
+        spawn_projectiles(game_info, game_info->spawn_projectiles);
+        game_info->spawn_projectiles = 0;
+    }
+    update_objects(game_info);
+    update_player(player, game_info);
     if (!player->attack && game_info->input[INPUT_THROW].presses) {
         //throw_projectile(player->rect, game_info, game_info);
         attack(player, game_info);
     }
     
-    Vec2f player_delta = get_player_pos_delta(player, game_info->input, &game_info->collision_info);
+    Entity_Store* entities = &game_info->entities;
+    Vec2f player_delta = get_player_pos_delta(player, entities, game_info->input, &game_info->collision_info);
 
-    player->e->rect = try_move_axis(player->e->rect, player_delta.x, AXIS_X, game_info->entities, game_info->entities_count, &game_info->collision_info);
-    player->e->rect = try_move_axis(player->e->rect, player_delta.y, AXIS_Y, game_info->entities, game_info->entities_count, &game_info->collision_info);
+    u32 player_slot = handle_slot(player->e);
+    Rectf player_rect = entity_rect(entities, player_slot);
+    player_rect = try_move_axis(player_rect, player_delta.x, AXIS_X, entities, &game_info->broadphase, &game_info->collision_info);
+    player_rect = try_move_axis(player_rect, player_delta.y, AXIS_Y, entities, &game_info->broadphase, &game_info->collision_info);
+    set_entity_rect(entities, player_slot, player_rect);
+    entity_moved(&game_info->broadphase, entities, player_slot);
 
     if (game_info->input[INPUT_EDITOR_CYCLE_DRAW].presses) {
         switch (game_info->currently_drawing) {
@@ -628,22 +2762,13 @@ bool update_game(Arena* frame_state, Arena* persistent_state) {
         }
     }
     draw_obstacle(game_info->drawing, game_info->mouse, game_info->camera, game_info, game_info->currently_drawing);
-    erase_obstacle(game_info->mouse, game_info->entities, game_info->entities_count, game_info->camera);
+    erase_obstacle(game_info->mouse, game_info, game_info->camera);
+    apply_entity_commands(game_info);
 
     if (game_info->input[INPUT_EDITOR_SAVE].presses) {
-        u32 persistent_reset = persistent_state->current;
-        u32 total_length = 0;
-        for (int i = 0; i < game_info->entities_count; ++i) {
-            Entity object = game_info->entities[i];
-            if (!object.type) continue;
-            u32 serialized_length = serialize_entity(object, *persistent_state);
-            total_length += serialized_length;
-            persistent_state->current += serialized_length;
-        }
-        persistent_state->current = persistent_reset;
-        game_info->platform_write_entire_file("test.txt", (const char*)arena_current(*persistent_state), total_length);
+        save_level("test.txt", game_info);
     }
 
-    assert(game_info->entities_count < ENTITIES_CAPACITY);
+    assert(game_info->entities.count <= ENTITIES_CAPACITY);
     return true;
 }
\ No newline at end of file
@@ -26,6 +26,7 @@ enum Entity_Type {
     ENTITY_SPIKE         = 32,
     ENTITY_DOOR          = 64,
 };
+#define ENTITY_TYPE_COUNT 7 // not counting ENTITY_NONE
 typedef u32 Entity_Type_Flag;
 
 enum Door_Flags {
@@ -41,25 +42,37 @@ enum Direction {
 };
 typedef u8 Direction_Flag;
 
+// Slot in the low 20 bits and the slot's generation in the high 12. Generations start at 1 and move on whenever
+// the slot is freed, so 0 is never a live entity and a handle to a freed slot stops validating.
+typedef u32 Entity_Handle;
+#define HANDLE_SLOT_BITS 20
+#define HANDLE_SLOT_MASK ((1u << HANDLE_SLOT_BITS) - 1)
+#define HANDLE_GENERATION_MASK 0xFFF
+// standing_on of objects resting on the tile map, tiles have no slot. Its generation is 0, so it never validates.
+#define STANDING_ON_TILES HANDLE_SLOT_MASK
+
+// A whole entity by value, to create or save one. Live entities are kept field by field in Entity_Store.
+// No default member initializers, copying one out of the store writes every field once. Start from {} instead.
 struct Entity {
-    Entity_Type type = {};
+    Entity_Type type;
     union {
-        Rectf rect = {};
+        Rectf rect;
         RECTF_DEFINITION(ANONYMOUS);
     };
-    f32     move_speed = {};
-    Direction facing = {};
-    bool    grounded = {};
-    Entity* standing_on = {};
-    Vec2f   velocity = {};
-    u16     flags = {};
+    f32     move_speed;
+    Direction facing;
+    bool    grounded;
+    Entity_Handle standing_on;
+    Vec2f   velocity;
+    u16     still_frames; // updates in a row that left rect and velocity as they were
+    bool    asleep;
 };
 
 struct Player {
-    Entity*   e;
-    Entity*   attack;
-    u32       attack_frames;
-    Direction transition_level_in_direction;
+    Entity_Handle e;
+    Entity_Handle attack;
+    u32           attack_frames;
+    Direction     transition_level_in_direction;
 };
 
 enum Axis {
@@ -103,14 +116,278 @@ struct Overlap_Info {
     Direction_Flag flags = 0;
 };
 
-struct Overlap_Info_Node {
-    Overlap_Info data = {};
-    Overlap_Info_Node* next = NULL;
+enum Overlap_Event_Kind {
+    OVERLAP_BEGIN,
+    OVERLAP_STAY,
+    OVERLAP_END,
+};
+
+// entity overlaps info.other_index and cares about it.
+struct Overlap_Event {
+    Overlap_Event_Kind kind;
+    u32 entity;
+    Overlap_Info info;
+};
+
+// Rect fields in separate arrays for batched overlap tests. Every array can be read 8 floats past count.
+struct Packed_Rects {
+    f32* posx;
+    f32* posy;
+    f32* radiusx;
+    f32* radiusy;
+    u32  count;
+};
+
+// Arrays indexed by slot are split into chunks of ENTITY_CHUNK_SIZE, taken from the persistent arena as the store
+// grows. A chunk never moves once taken, so growing doesn't copy anything or invalidate pointers into it.
+#define ENTITY_CHUNK_SHIFT 10
+#define ENTITY_CHUNK_SIZE (1 << ENTITY_CHUNK_SHIFT)
+#define ENTITY_CHUNKS_CAPACITY 128
+#define ENTITIES_CAPACITY (ENTITY_CHUNK_SIZE * ENTITY_CHUNKS_CAPACITY)
+#define CHUNKED_ARRAY(T, chunks_capacity) struct {\
+    typedef T Item;\
+    T* chunks[chunks_capacity];\
+    T& operator[](u32 index) { return chunks[index >> ENTITY_CHUNK_SHIFT][index & (ENTITY_CHUNK_SIZE - 1)]; }\
+}
+#define CHUNKED(T) CHUNKED_ARRAY(T, ENTITY_CHUNKS_CAPACITY)
+
+// Slots of one entity type, packed in no particular order, so an update only walks the entities it is for.
+struct Entity_Table {
+    CHUNKED(u32) slots;
+    u32 count;
+};
+
+// Fields only a few updates and the renderer read, kept together so they stay out of the collision loops' way.
+struct Entity_Cold {
+    f32       move_speed;
+    Direction facing;
+};
+
+// Which slots have a component and where their item is. A chunk of dense_of_slot is only taken once a slot in it
+// gets the component, so data only a few entities have costs about what their items do.
+struct Sparse_Set {
+    CHUNKED(u32) dense_of_slot; // item index + 1, 0 for slots without the component
+    CHUNKED(u32) slots;         // slot of each item
+    u32          count;
+};
+
+// Data only some entities have. Items are packed in no particular order, a loop over all of them reads nothing else.
+#define COMPONENT(T) struct {\
+    Sparse_Set set;\
+    CHUNKED(T) items;\
+}
+
+struct Door {
+    u16 flags; // Door_Flags
+};
+
+enum Journal_Change {
+    JOURNAL_CREATED = 1,
+    JOURNAL_DELETED = 2,
+    JOURNAL_MOVED   = 4,
+};
+
+// A slot's first change this frame, with the slot as it was before. The store has how it ended up,
+// a slot can be freed and taken again within a frame.
+struct Journal_Entry {
+    u32         slot;
+    Entity_Type previous_type; // ENTITY_NONE if the slot was free
+    Rectf       previous_rect;
+    u8          changes;       // Journal_Change
+};
+
+// Slots that changed this frame, so consumers can do work in proportion to the changes instead of the store.
+// Entries are in the frame arena and stay valid until it is cleared.
+struct Entity_Journal {
+#define JOURNAL_CAPACITY 4096
+    Journal_Entry* entries;
+    u32            count;
+    u32            frame;
+    bool           overflowed; // more changes than fit, or a new level, consumers have to rescan the store
+};
+
+// Where a slot's entry is, if frame is the journal's. Checking the frame first keeps a slot's first change
+// this frame from reading a stale entry.
+struct Journal_Mark {
+    u32 frame;
+    u32 index;
+};
+
+// Live entities with one array per field, indexed by slot, so a loop only pulls in the fields it reads.
+// Chunks start on a cache line, so a slot's rect is one aligned 16 byte load and never straddles two lines.
+struct Entity_Store {
+    CHUNKED(Entity_Type)   type;
+    CHUNKED(Rectf)         rect;
+    CHUNKED(Vec2f)         velocity;
+    CHUNKED(Entity_Cold)   cold;
+    CHUNKED(bool)          grounded;
+    CHUNKED(Entity_Handle) standing_on;
+    CHUNKED(u16)           still_frames;
+    CHUNKED(bool)          asleep;
+    CHUNKED(u16)           generation;
+    CHUNKED(u32)           table_index; // where the slot is in its type's table
+    CHUNKED(Journal_Mark)  journal_mark;
+    u32                    count;
+    u32                    chunks_count;
+    Entity_Table           tables[ENTITY_TYPE_COUNT]; // by the bit of the type
+    COMPONENT(Door)        doors;
+    Entity_Journal         journal;
+};
+static_assert(ENTITIES_CAPACITY <= HANDLE_SLOT_MASK + 1, "slots have to fit in an Entity_Handle");
+static_assert(sizeof(Rectf) == 16 && CACHE_LINE_SIZE % sizeof(Rectf) == 0, "a rect has to be one aligned SSE load");
+static_assert(sizeof(Entity_Cold) == 8, "cold fields grew, check they still belong together");
+
+struct Entity_Pair {
+    u32 a;
+    u32 b;
+};
+
+enum Broadphase {
+    BROADPHASE_BRUTE_FORCE,
+    BROADPHASE_GRID,
+    BROADPHASE_SWEEP_AND_PRUNE,
+    BROADPHASE_DYNAMIC_TREE,
+    BROADPHASE_ENUM_COUNT,
+};
+
+struct Broadphase_Stats {
+    u32 pairs_tested;      // pairs the broadphase looked at
+    u32 candidates;        // pairs handed on to rectf_overlap
+    u32 move_rects_tested; // rects try_move_axis looked at
+    u32 tree_reinserts;    // entities that left their fattened box in the dynamic tree
+    u32 dirty_entities;    // slots that moved or changed type since the last frame
+    u32 cached_pairs;      // candidates skipped since neither side changed
+};
+
+// Slots of some types sorted by the left edge of their rect. The order is kept between frames,
+// entities barely move each frame so re-sorting is close to a single pass.
+// The arrays are read in batches and can't be chunked, they are reallocated at double the capacity instead.
+struct Sweep_And_Prune {
+    u32* order;
+    f32* minx;
+    u32  count;
+    u32  capacity; // slots, the rects have 8 more
+    bool* in_order; // by slot
+    // Rects at sort time in sorted order. Statics don't move, so for them these stay exact all frame.
+    f32* posx;
+    f32* posy;
+    f32* radiusx;
+    f32* radiusy;
+    f32  max_width;
+};
+
+// How try_move_axis finds the statics it can run into.
+enum Static_Query {
+    STATIC_QUERY_LINEAR,
+    STATIC_QUERY_SWEEP,
+    STATIC_QUERY_TREE,
+    STATIC_QUERY_ENUM_COUNT,
+};
+
+struct Static_Tree_Node {
+    Rectf bounds;
+    u32   first; // first of the two children, or first entry in leaf_entities for a leaf
+    u16   count; // leaf entries, 0 for inner nodes
+};
+
+// Bounding volume hierarchy over the slots of one type. Children always come after their parent.
+// Editing rebakes a subtree into free room after the live one, a full bake compacts once that runs out.
+struct Static_Tree {
+#define STATIC_TREE_LEAF_SIZE 4
+    Entity_Type type;
+    Static_Tree_Node* nodes; // room for twice capacity
+    u32 nodes_count;
+    u32* leaf_entities;
+    u32 leaves_count; // including entries a rebake left behind
+    u32 capacity;     // leaf entries, grows in the persistent arena
+    // Rects of leaf_entities, a leaf of up to 4 is one batched overlap test.
+    f32* posx;
+    f32* posy;
+    f32* radiusx;
+    f32* radiusy;
+};
+
+// Level geometry never moves, so it is baked at load into trees of its own. Its entities keep their slots for handles,
+// saving and the editor, but stay out of the dynamic tree and the overlap broadphase. Collision, spikes and drawing
+// go through the layer instead of the slots, and the editor rebakes just the part of a tree around what it changed.
+#define STATIC_LAYER_TYPES (ENTITY_STATIC | ENTITY_SPIKE)
+struct Static_Layer {
+    Static_Tree solids; // ENTITY_STATIC
+    Static_Tree spikes; // ENTITY_SPIKE
+    Sweep_And_Prune solids_sweep; // ENTITY_STATIC, for STATIC_QUERY_SWEEP
+    bool solids_sweep_stale;      // sorted again before the next query that uses it
+};
+
+struct Dynamic_Tree_Node {
+    Rectf bounds; // fattened for leaves
+    s32   parent; // next free node while on the free list
+    s32   child1;
+    s32   child2;
+    s32   entity; // slot for leaves, -1 for inner nodes
+    s32   height; // 0 for leaves
+    bool  moved;  // leaf is waiting in Dynamic_Tree::moved
 };
 
-struct Overlap_Info_List {
-    Overlap_Info_Node* first = NULL;
-    Overlap_Info_Node* last  = NULL;
+// AABB tree over every entity outside the static layer, leaves keep a fattened box
+// so an entity only causes a tree update once it moves out of it.
+// New and moved leaves are only put in place by the next query, all at once when enough of them piled up.
+struct Dynamic_Tree {
+    CHUNKED_ARRAY(Dynamic_Tree_Node, 2 * ENTITY_CHUNKS_CAPACITY) nodes; // two chunks for every chunk of slots
+    s32 nodes_count;
+    s32 root;
+    s32 free_node;
+    u32 leaves_count;
+    CHUNKED(u32) leaf_of_entity; // node + 1, 0 when the slot has no leaf
+    s32* moved;      // leaves to put back in place, may repeat a node that was freed and reused
+    u32  moved_count;
+    u64* build_keys; // room for twice capacity, sorted by dynamic_tree_rebuild
+    u32  capacity;
+};
+
+// Overlaps from the last frame, kept until one of the two slots moves or changes type.
+struct Pair_Cache {
+    Overlap_Event* overlaps; // sorted by entity, then other_index, in the frame arena of the update that wrote them
+    u32 overlaps_count;
+    u64 overlaps_frame;
+    // Slots as of the last update, to tell which ones changed.
+    CHUNKED(Entity_Type) types;
+    CHUNKED(Rectf) rects;
+    u32 entities_count;
+};
+
+enum Tile {
+    TILE_EMPTY,
+    TILE_SOLID,
+    TILE_SPIKE,
+};
+
+// Dense grid of level geometry, tile (0, 0) has its lower left corner at origin. While enabled, statics and spikes
+// from the level file that are made of whole tiles inside the grid are rasterized into it at load, and the editor
+// paints such rects into it instead of creating entities. Everything else stays an entity.
+struct Tile_Map {
+#define TILE_MAP_WIDTH  512
+#define TILE_MAP_HEIGHT 128
+#define TILE_SIZE .5f
+    u8    tiles[TILE_MAP_WIDTH * TILE_MAP_HEIGHT]; // Tile, row by row from the bottom
+    Vec2f origin;
+    bool  enabled; // wanted from the next load on
+    bool  active;  // whether the loaded level uses the map, set by load_level
+};
+
+struct Broadphase_State {
+    Broadphase       kind;
+    Static_Query     static_query;
+    Broadphase_Stats stats;
+    Sweep_And_Prune  sweep; // everything outside the static layer, for BROADPHASE_SWEEP_AND_PRUNE
+    Static_Layer     statics;
+    Dynamic_Tree     dynamic_tree;
+    Pair_Cache       pair_cache;
+    Tile_Map         tile_map;
+};
+
+struct Raycast_Hit {
+    u32 index;
+    f32 t; // where the segment enters the rect, 0 at its start and 1 at its end
 };
 
 struct Collision_Info {
@@ -128,9 +405,24 @@ struct Camera {
     f32 scale;
 };
 
-typedef u32  (*Platform_Read_Entire_File)(Arena, const char*);
+typedef u32  (*Platform_Read_Entire_File)(Arena*, const char*); // pushes the contents, returns their size
 typedef bool (*Platform_Write_Entire_File)(const char*, const char*, u32);
 
+struct Deferred_Create {
+    u32         slot;
+    Entity_Type type;
+};
+
+// Creates and deletes made while updating, applied together at the end of the frame so the update sees the
+// same entities throughout. A deferred create takes its slot and handle right away, but the slot stays
+// ENTITY_NONE, out of its table and out of the broadphase until it is applied.
+struct Entity_Commands {
+    CHUNKED(Deferred_Create) creates;
+    CHUNKED(u32)             deletes; // slots
+    u32                      creates_count;
+    u32                      deletes_count;
+};
+
 struct Game_Info {
     Platform_Read_Entire_File platform_read_entire_file;
     Platform_Write_Entire_File platform_write_entire_file;
@@ -143,18 +435,26 @@ struct Game_Info {
     u8      input_text_count;
     Drawing_Obstacle drawing;
     Entity_Type currently_drawing;
+    Broadphase_State broadphase;
 
     Player  player;
     Input   input[INPUT_ENUM_COUNT];
     Camera  camera;
     Mouse*  mouse;
+    Scratch_Pool* scratch_pool; // set by the platform, the current frame arena is one of them
+    Frame_Arenas* frame_arenas; // set by the platform, update_game's frame_state is the current one
+    Arena*  persistent_arena; // set every frame, entity chunks are taken from it
     Collision_Info collision_info;
-#define ENTITIES_CAPACITY 2000
-    Entity  entities[ENTITIES_CAPACITY];
-    u32     entities_count;
+    Entity_Store entities;
     s32     frame_pointer_delta;
-    u16     empty_entities[ENTITIES_CAPACITY];
-    u16     empty_entities_count;
+    CHUNKED(u32) empty_entities;
+    u32     empty_entities_count;
+    Entity_Commands commands;
+    u32     active_entities_count;
+    u32     sleeping_entities_count;
+    u32     spawn_projectiles; // set from the debug window, spawned by the next update
+#define STRESS_PROJECTILES 100000
+#define UPDATE_BUDGET_MS 16.6f // a 60Hz frame, the update has to fit in it even with the stress spawn live
 };
 
 //Rectf get_updated_player(Rectf last_player, Input input);
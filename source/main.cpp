@@ -118,11 +118,6 @@ void cursor_position_callback(GLFWwindow* window, double posx, double posy) {
 }
 
 
-void clear_arena(Arena* arena) {
-    memset(arena->data, 0, arena->capacity);
-    arena->current = 0;
-}
-
 FILETIME get_write_time(char* file) {
     FILETIME write_time = {};
     WIN32_FILE_ATTRIBUTE_DATA data;
@@ -132,7 +127,8 @@ FILETIME get_write_time(char* file) {
     return (write_time);
 }
 
-u32 read_entire_file(Arena arena, const char* file_path) {
+// Pushes the file's contents onto the arena and returns their size.
+u32 read_entire_file(Arena* arena, const char* file_path) {
     HANDLE handle = CreateFileA(file_path,
                                 GENERIC_READ,
                                 FILE_SHARE_READ,
@@ -147,11 +143,14 @@ u32 read_entire_file(Arena arena, const char* file_path) {
     }
     DWORD bytes_read = 0;
     if (do_read_file) {
-        bool success = ReadFile(handle, arena_current(arena), arena.capacity - arena.current, &bytes_read, NULL);
+        DWORD file_size = GetFileSize(handle, NULL);
+        u64 start = arena->current;
+        bool success = ReadFile(handle, push_array_no_zero(arena, u8, file_size), file_size, &bytes_read, NULL);
         if (!success) {
             printf("Failed reading from: %s\nError code: %d\n", file_path, GetLastError());
 
         }
+        arena->current = start + bytes_read;
     }
     CloseHandle(handle);
     return bytes_read;
@@ -263,10 +262,11 @@ void unload_game_code(Game_Code* game_code) {
     game_code->update_function = 0;
 }
 
-u32 load_shader(const char* file_name, Arena arena, GLenum shader_type)
+u32 load_shader(const char* file_name, Scratch_Pool* scratch_pool, GLenum shader_type)
 {
-    u32 start_of_shader_text = arena.current;
-    u32 bytes_read = read_entire_file(arena, file_name);
+    Temp_Memory scratch = get_scratch(scratch_pool, NULL);
+    const GLchar* shader_source = (GLchar*)arena_current(scratch.arena);
+    u32 bytes_read = read_entire_file(scratch.arena, file_name);
     if (bytes_read == 0) {
         printf("Failed to get shader, exiting...");
         assert(false);
@@ -276,25 +276,27 @@ u32 load_shader(const char* file_name, Arena arena, GLenum shader_type)
         printf("Failed to create shader");
         assert(false);
     }
-    const GLchar* shader_source = (GLchar*) arena.data + start_of_shader_text;
     glShaderSource(shader, 1, &shader_source, (GLint*)&bytes_read);
     glCompileShader(shader);
-    arena.current = start_of_shader_text;
     GLint success;
     glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
     if (!success) {
         GLint log_length;
         glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &log_length);
-        char* error_info = (char*)arena.data + arena.current;
+        char* error_info = push_array_no_zero(scratch.arena, char, log_length);
         glGetShaderInfoLog(shader, log_length, nullptr, error_info);
         printf("Shader compilation error in '%s':\n%s", file_name, error_info);
         assert(false);
     }
+    end_temp_memory(scratch);
     return shader;
 }
 
 
-u32 text_to_char_coords(const char* text, u32 text_count, Vec2f starting_offset, Arena arena) {
+// Lays out one glyph per char other than newlines, contiguous at *glyphs. Returns the glyphs written.
+u32 text_to_char_coords(const char* text, u32 text_count, Vec2f starting_offset, Arena* arena, Pos_Offset** glyphs) {
+    *glyphs = push_array_no_zero(arena, Pos_Offset, text_count);
+    u32 glyphs_count = 0;
     int i = 0;
     f32 x_pos = starting_offset.x;
     f32 y_pos = starting_offset.y;
@@ -308,11 +310,32 @@ u32 text_to_char_coords(const char* text, u32 text_count, Vec2f starting_offset,
         //40 * 7
         f32 x_offset = c % 40;
         f32 y_offset = c / 40;
-        Pos_Offset* result = (Pos_Offset*)arena_append(&arena, sizeof(Pos_Offset));
-        *result = Pos_Offset{ x_pos, y_pos, x_offset, y_offset };
+        (*glyphs)[glyphs_count++] = Pos_Offset{ x_pos, y_pos, x_offset, y_offset };
         ++x_pos;
     }
-    return i;
+    return glyphs_count;
+}
+
+// Leaves of a static layer tree that reach into view, straight from the rects packed at bake time.
+void draw_static_tree(Static_Tree* tree, Rectf view, GLuint offset_location, GLuint scale_location) {
+    u32 stack[64];
+    u32 stack_count = 0;
+    if (tree->nodes_count) stack[stack_count++] = 0;
+    while (stack_count) {
+        Static_Tree_Node* node = tree->nodes + stack[--stack_count];
+        if (!check_collided(view, node->bounds)) continue;
+        if (node->count) {
+            for (u32 i = node->first; i < node->first + node->count; ++i) {
+                glUniform2f(offset_location, tree->posx[i], tree->posy[i]);
+                glUniform2f(scale_location, tree->radiusx[i], tree->radiusy[i]);
+                glDrawArrays(GL_TRIANGLES, 0, 6);
+            }
+        } else {
+            assert(stack_count + 2 <= 64);
+            stack[stack_count++] = node->first;
+            stack[stack_count++] = node->first + 1;
+        }
+    }
 }
 
 int main(void) {
@@ -433,23 +456,22 @@ int main(void) {
 
     //
     // Create memory arenas
-    Arena persistent;
-    persistent.data = (u8*)malloc(PERSISTENT_ARENA_SIZE + FRAME_ARENA_SIZE); // 1.5 MB
-    persistent.capacity = PERSISTENT_ARENA_SIZE;
-    persistent.current = 0;
-    Arena frame_arena;
-    frame_arena.data = persistent.data + persistent.capacity;
-    frame_arena.capacity = FRAME_ARENA_SIZE;
-    frame_arena.current = 0;
+    Arena persistent    = arena_reserve(PERSISTENT_ARENA_SIZE);
+    Frame_Arenas frame_arenas = {};
+    frame_arenas.arenas[0] = arena_reserve(FRAME_ARENA_SIZE);
+    frame_arenas.arenas[1] = arena_reserve(FRAME_ARENA_SIZE);
+    Arena* frame_arena = frame_arena_current(&frame_arenas);
+    Arena scratch_arena = arena_reserve(SCRATCH_ARENA_SIZE);
+    Scratch_Pool scratch_pool = { { &scratch_arena, frame_arena } }; // the frame arena only serves when scratch_arena conflicts
     //
     // Load shaders
     u32 shader_program;
     u32 text_shader_program;
     {
-        u32 vertex_shader =        load_shader("../assets/vertex.txt",   persistent, GL_VERTEX_SHADER);
-        u32 fragment_shader =      load_shader("../assets/fragment.txt", persistent, GL_FRAGMENT_SHADER);
-        u32 text_fragment_shader = load_shader("../assets/text_fragment.txt", persistent, GL_FRAGMENT_SHADER);
-        u32 text_vertex_shader =   load_shader("../assets/text_vertex.txt", persistent, GL_VERTEX_SHADER);
+        u32 vertex_shader =        load_shader("../assets/vertex.txt",   &scratch_pool, GL_VERTEX_SHADER);
+        u32 fragment_shader =      load_shader("../assets/fragment.txt", &scratch_pool, GL_FRAGMENT_SHADER);
+        u32 text_fragment_shader = load_shader("../assets/text_fragment.txt", &scratch_pool, GL_FRAGMENT_SHADER);
+        u32 text_vertex_shader =   load_shader("../assets/text_vertex.txt", &scratch_pool, GL_VERTEX_SHADER);
 
         shader_program = glCreateProgram();
         if (shader_program == 0) {
@@ -500,9 +522,11 @@ int main(void) {
     GLuint color_location = glGetUniformLocation(shader_program, "color");
     GLuint rect_color_location = glGetUniformLocation(shader_program, "rect_color");
     // Game_Info is stored at start of the persistent arena.
-    Game_Info* game_info = (Game_Info*)arena_append(&persistent, sizeof(Game_Info));
+    Game_Info* game_info = push_struct(&persistent, Game_Info);
     game_info->platform_read_entire_file = read_entire_file;
     game_info->platform_write_entire_file = write_entire_file;
+    game_info->scratch_pool = &scratch_pool;
+    game_info->frame_arenas = &frame_arenas;
     game_info->input_text = global_input_text;
     game_info->game_state_is_initialiezed = false;
     //
@@ -514,6 +538,9 @@ int main(void) {
     bool even_frame = false;
     bool game_wants_to_keep_running = true;
     f32 last_time = 0;
+    f32 worst_update_ms = 0; // since the last stress spawn, not counting the spawn itself
+    u32 updates_over_budget = 0;
+    bool spawn_update_pending = false;
     {
         u32 result = timeBeginPeriod(1);
         assert(result == TIMERR_NOERROR);
@@ -530,7 +557,8 @@ int main(void) {
             if (!game_code.valid) return -1;
         }
 
-        clear_arena(&frame_arena);
+        frame_arena = frame_arenas_begin(&frame_arenas);
+        scratch_pool.arenas[1] = frame_arena;
 #define MIN_FRAME_TIME .0016f
 
         f32 current_time = glfwGetTime() - last_time;
@@ -550,10 +578,48 @@ int main(void) {
         ImGui_ImplGlfw_NewFrame();
         ImGui::NewFrame();
 
-        game_wants_to_keep_running = game_code.update_function(&frame_arena, &persistent);
+        f64 update_start = glfwGetTime();
+        game_wants_to_keep_running = game_code.update_function(frame_arena, &persistent);
+        f32 update_ms = (f32)((glfwGetTime() - update_start) * 1000);
+        if (spawn_update_pending) {
+            spawn_update_pending = false;
+        } else {
+            worst_update_ms = MAX(worst_update_ms, update_ms);
+            if (update_ms > UPDATE_BUDGET_MS) ++updates_over_budget;
+        }
 
         ImGui::Begin("Entity info");
-        ImGui::Text("Empty entities: %d", game_info->empty_entities_count);
+        ImGui::Text("Entities: %d, empty: %d", game_info->entities.count, game_info->empty_entities_count);
+        ImVec4 budget_color = update_ms > UPDATE_BUDGET_MS ? ImVec4(1, .3f, .3f, 1) : ImVec4(.3f, 1, .3f, 1);
+        ImGui::TextColored(budget_color, "Update: %.2f ms of %.1f ms", update_ms, UPDATE_BUDGET_MS);
+        ImGui::Text("Worst: %.2f ms, over budget: %d", worst_update_ms, updates_over_budget);
+        if (ImGui::Button("Spawn 100k projectiles")) {
+            game_info->spawn_projectiles = STRESS_PROJECTILES;
+            worst_update_ms = 0;
+            updates_over_budget = 0;
+            spawn_update_pending = true;
+        }
+        const char* broadphase_names[BROADPHASE_ENUM_COUNT] = { "Brute force", "Grid", "Sweep and prune", "Dynamic tree" };
+        ImGui::Combo("Broadphase", (int*)&game_info->broadphase.kind, broadphase_names, BROADPHASE_ENUM_COUNT);
+        const char* static_query_names[STATIC_QUERY_ENUM_COUNT] = { "Linear", "Sweep", "Tree" };
+        ImGui::Combo("Static query", (int*)&game_info->broadphase.static_query, static_query_names, STATIC_QUERY_ENUM_COUNT);
+        ImGui::Checkbox("Tile map (takes effect on load)", &game_info->broadphase.tile_map.enabled);
+        Broadphase_Stats stats = game_info->broadphase.stats;
+        ImGui::Text("Pairs tested: %d, candidates: %d", stats.pairs_tested, stats.candidates);
+        ImGui::Text("Move rects tested: %d", stats.move_rects_tested);
+        ImGui::Text("Dynamic tree reinserts: %d", stats.tree_reinserts);
+        ImGui::Text("Dirty entities: %d, cached pairs: %d", stats.dirty_entities, stats.cached_pairs);
+        ImGui::Text("Active: %d, sleeping: %d", game_info->active_entities_count, game_info->sleeping_entities_count);
+        Entity_Journal* journal = &game_info->entities.journal;
+        if (journal->overflowed) ImGui::Text("Changed: more than %d", JOURNAL_CAPACITY);
+        else                     ImGui::Text("Changed: %d", journal->count);
+        Arena* arenas[] = { &persistent, frame_arena, frame_arena_previous(&frame_arenas), &scratch_arena };
+        const char* arena_names[] = { "Persistent", "Frame", "Last frame", "Scratch" };
+        for (u32 i = 0; i < 4; ++i) {
+            ImGui::Text("%s arena: %.2f MB used, %.2f MB peak, %.2f MB committed in %d commits", arena_names[i],
+                        arenas[i]->current / (f32)(KILOBYTE*KILOBYTE), arenas[i]->high_water / (f32)(KILOBYTE*KILOBYTE),
+                        arenas[i]->committed / (f32)(KILOBYTE*KILOBYTE), arenas[i]->commits);
+        }
         ImGui::End();
 
         ImGui::Render();
@@ -568,30 +634,32 @@ int main(void) {
         glUniform2f(camera_location, game_info->camera.posx, game_info->camera.posy);
         glUniform2f(world_scale_location, 2/(screen_width*game_info->camera.scale), 2/(screen_height*game_info->camera.scale));
         glBindVertexArray(rect_VAO);
-        
-        for (int i = 0; i < game_info->entities_count; i++) {
-            Entity object = game_info->entities[i];
-            if (!object.type) continue;
-            Rectf rect = object.rect;
-            glUniform2f(offset_location, rect.posx, rect.posy);
-            glUniform2f(scale_location, rect.radiusx, rect.radiusy);
+
+        // The camera is the lower left corner of the screen.
+        Camera camera = game_info->camera;
+        Rectf view = { camera.posx + screen_width * camera.scale / 2, camera.posy + screen_height * camera.scale / 2,
+                       screen_width * camera.scale / 2, screen_height * camera.scale / 2 };
+        glUniform3f(rect_color_location, .3, .3, .3);
+        draw_static_tree(&game_info->broadphase.statics.solids, view, offset_location, scale_location);
+        glUniform3f(rect_color_location, 1, 1, 1);
+        draw_static_tree(&game_info->broadphase.statics.spikes, view, offset_location, scale_location);
+
+        Entity_Store* entities = &game_info->entities;
+        for (int i = 0; i < entities->count; i++) {
+            if (!entities->type[i] || (entities->type[i] & STATIC_LAYER_TYPES)) continue;
+            glUniform2f(offset_location, entities->rect[i].posx, entities->rect[i].posy);
+            glUniform2f(scale_location, entities->rect[i].radiusx, entities->rect[i].radiusy);
             glUniform3f(rect_color_location, 0, 1, 0);
-            switch (object.type) {
+            switch (entities->type[i]) {
                 case ENTITY_PLAYER:
                 case ENTITY_PLAYER_ATTACK:
                     glUniform3f(rect_color_location, .1, 0, .8);
                     break;
-                case ENTITY_STATIC:
-                    glUniform3f(rect_color_location, .3, .3, .3);
-                    break;
                 case ENTITY_MONSTER:
                     glUniform3f(rect_color_location, 1, 0, 0);
                     break;
-                case ENTITY_SPIKE:
-                    glUniform3f(rect_color_location, 1, 1, 1);
-                    break;
                 case ENTITY_DOOR:
-                    if (object.flags & DOOR_OPEN) {
+                    if (COMPONENT_GET(entities->doors, i)->flags & DOOR_OPEN) {
                         glUniform3f(rect_color_location, .5, .8, .5);    
                     } else {
                         glUniform3f(rect_color_location, .5, .2, .5);
@@ -599,6 +667,18 @@ int main(void) {
             }
             glDrawArrays(GL_TRIANGLES, 0, 6);
         }
+        if (game_info->broadphase.tile_map.active) {
+            u32 cursor = 0;
+            Tile tile;
+            Rectf rect;
+            while (tile_map_next_run(&game_info->broadphase.tile_map, &cursor, &tile, &rect)) {
+                glUniform2f(offset_location, rect.posx, rect.posy);
+                glUniform2f(scale_location, rect.radiusx, rect.radiusy);
+                if (tile == TILE_SOLID) glUniform3f(rect_color_location, .3, .3, .3);
+                else                    glUniform3f(rect_color_location, 1, 1, 1);
+                glDrawArrays(GL_TRIANGLES, 0, 6);
+            }
+        }
 
         //
         // draw text
@@ -607,9 +687,12 @@ int main(void) {
         glBindVertexArray(text_VAO);
 
         if (game_info->input_text_count) {
-            game_info->display_text_chars_to_draw_count = text_to_char_coords(game_info->display_text, game_info->display_text_count, Vec2f{0, 0}, persistent);
+            Temp_Memory scratch = get_scratch(&scratch_pool, NULL);
+            Pos_Offset* glyphs;
+            game_info->display_text_chars_to_draw_count = text_to_char_coords(game_info->display_text, game_info->display_text_count, Vec2f{0, 0}, scratch.arena, &glyphs);
             glBindBuffer(GL_ARRAY_BUFFER, text_VBO);
-            glBufferData(GL_ARRAY_BUFFER, game_info->display_text_chars_to_draw_count * sizeof(Pos_Offset), arena_current(persistent), GL_STATIC_DRAW);
+            glBufferData(GL_ARRAY_BUFFER, game_info->display_text_chars_to_draw_count * sizeof(Pos_Offset), glyphs, GL_STATIC_DRAW);
+            end_temp_memory(scratch);
         }
         glDrawArraysInstanced(GL_TRIANGLES, 0, 6, game_info->display_text_chars_to_draw_count);
 